@@ -157,6 +157,8 @@
 #define SHT_REL            9
 #define SHT_SHLIB          10
 #define SHT_DYNSYM         11
+#define SHT_INIT_ARRAY     14
+#define SHT_FINI_ARRAY     15
 #define SHT_LOPROC         0x70000000
 #define SHT_HIPROC         0x7fffffff
 #define SHT_LOUSER         0x80000000
@@ -245,6 +247,10 @@
 #define DT_TEXTREL         22         /* d_un=ignored */
 #define DT_JMPREL          23         /* d_un=d_ptr */
 #define DT_BINDNOW         24         /* d_un=ignored */
+#define DT_INIT_ARRAY      25         /* d_un=d_ptr */
+#define DT_FINI_ARRAY      26         /* d_un=d_ptr */
+#define DT_INIT_ARRAYSZ    27         /* d_un=d_val */
+#define DT_FINI_ARRAYSZ    28         /* d_un=d_val */
 #define DT_LOPROC          0x70000000 /* d_un=unspecified */
 #define DT_HIPROC          0x7fffffff /* d_un= unspecified */
 
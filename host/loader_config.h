@@ -40,6 +40,48 @@
 #define LOADER_USERDATA_T loader_env_t
 
 #define LOADER_GETUNDEFSYMADDR(userdata, name) getUndefinedSymbol(userdata, name)
+#define LOADER_GETIMPORTADDR(userdata, abi, ordinal) getImportSymbol(userdata, abi, ordinal)
+#define LOADER_PLACEMENT(userdata) ((userdata)->env->placement)
+
+#define LOADER_METADATA_CACHE
+#if 0
+#define LOADER_METADATA_KEEP
+#endif
+
+#if 0
+#define LOADER_STREAM
+#endif
+
+#if 0
+#define LOADER_INCREMENTAL
+#define LOADER_STEP_BYTES 256
+#endif
+
+#if 0
+#define LOADER_BLOCK_CACHE_BLOCKS 4
+#define LOADER_BLOCK_CACHE_SIZE 512
+#endif
+
+#define LOADER_SYMBOL_INDEX
+#if 0
+#define LOADER_CLOSE_AFTER_LOAD
+#endif
+
+#if 0
+extern int flash_write(uint32_t addr, const void *src, size_t size);
+#define LOADER_FLASH_WRITE(userdata, addr, src, size) flash_write(addr, src, size)
+#define LOADER_BUILD_ID(userdata) ((userdata)->env->build_id)
+#endif
+
+#if 0
+extern const void *reloc_cache_get(uint32_t key);
+extern void reloc_cache_put(uint32_t key, const void *data, size_t size);
+#define LOADER_RELOC_CACHE_GET(userdata, key) reloc_cache_get(key)
+#define LOADER_RELOC_CACHE_PUT(userdata, key, data, size) reloc_cache_put(key, data, size)
+#ifndef LOADER_BUILD_ID
+#define LOADER_BUILD_ID(userdata) ((userdata)->env->build_id)
+#endif
+#endif
 
 #if 0
 
@@ -137,6 +179,8 @@ extern void *do_alloc_sdram(size_t size, size_t align, ELFSecPerm_t perm);
 extern int is_streq(const char *s1, const char *s2);
 
 #define LOADER_FREE(ptr) free(ptr)
+#define LOADER_MEMCPY(dst, src, size) memcpy(dst, src, size)
+#define LOADER_CLEAR(ptr, size) memset(ptr, 0, size)
 #define LOADER_STREQ(s1, s2) (is_streq(s1, s2))
 
 #if 0
@@ -149,6 +193,15 @@ extern void arch_jumpTo(entry_t entry);
 
 #endif
 
+extern void arch_callPic(entry_t entry, void *base);
+
+#define LOADER_CALL_PIC(entry, base) arch_callPic(entry, base)
+
+#if 0
+extern void arch_lazyEntry(void);
+#define LOADER_LAZY_ENTRY arch_lazyEntry
+#endif
+
 #define DBG(...) printf("ELF: " __VA_ARGS__)
 #define ERR(...) do { printf("ELF: " __VA_ARGS__); __asm__ volatile ("bkpt"); } while(0)
 #define MSG(msg) puts("ELF: " msg)
@@ -171,11 +224,213 @@ extern void arch_jumpTo(entry_t entry);
  * Undefined-symbol resolver
  *
  * @param userdata
- * @param name symbol name
+ * @param name symbol name (const ELFName_t *), compare it with
+ * elf_name_eq() or hash it with elf_name_hash_stream()
  * @retval address of symbol, 0xffffffff if not resolved
  */
 #define LOADER_GETUNDEFSYMADDR
 
+/**
+ * Section name buffer size
+ *
+ * Section names are read into a stack buffer of this size, longer names
+ * are truncated. Symbol names are streamed and have no limit
+ */
+#define LOADER_MAX_SYM_LENGTH
+
+/**
+ * Metadata cache mode
+ *
+ * If defined, section header table, section names, symbol table and symbol
+ * names are read into one RAM buffer when loading starts. Relocation and
+ * symbol lookups are then served from RAM instead of seek/read calls.
+ * If there is not enough memory the loader falls back to file access
+ */
+#define LOADER_METADATA_CACHE
+
+/**
+ * Keep metadata cache after load
+ *
+ * If defined along with #LOADER_METADATA_CACHE the metadata buffer is kept
+ * until #unload_elf, so #get_sym and friends don't need file access.
+ * Otherwise it is released when #load_elf returns
+ */
+#define LOADER_METADATA_KEEP
+
+/**
+ * Stream loading
+ *
+ * If defined, #load_elf_stream loads relocatable modules from a stream
+ * read only front to back (#LOADER_SEEK_FROM_START and #LOADER_TELL are
+ * not used for it). Needs #LOADER_METADATA_CACHE
+ */
+#define LOADER_STREAM
+
+/**
+ * Incremental loading
+ *
+ * If defined, #load_begin, #load_step and #load_finish load a module in
+ * bounded steps instead of a single #load_elf call
+ */
+#define LOADER_INCREMENTAL
+
+/**
+ * Bytes per incremental load unit
+ *
+ * Metadata (#LOADER_METADATA_CACHE) or section data read or cleared per
+ * unit of #load_step budget (default 256)
+ */
+#define LOADER_STEP_BYTES
+
+/**
+ * Block cache
+ *
+ * Number of blocks of the read cache placed between the loader and
+ * #LOADER_READ. If defined, small reads (headers, symbols, names,
+ * relocations) are served from LRU-managed blocks of
+ * #LOADER_BLOCK_CACHE_SIZE bytes. Use #get_cache_stats to size it
+ */
+#define LOADER_BLOCK_CACHE_BLOCKS
+
+/**
+ * Block cache block size
+ *
+ * Size in bytes of each block of the block cache (default 512)
+ */
+#define LOADER_BLOCK_CACHE_SIZE
+
+/**
+ * Relocation batch size
+ *
+ * Number of relocation entries read, resolved and applied at once
+ * (default 16). Each entry uses 20 bytes of stack while relocating
+ */
+#define LOADER_REL_BATCH
+
+/**
+ * Far branch veneers per island
+ *
+ * A BL or B.W that can't reach its target (more than 16 MB away, as from
+ * external RAM to flash) is redirected to an 8 byte veneer next to the
+ * calling code. Veneers are allocated from the region of the code in
+ * islands of this many (default 8), one veneer per distinct target
+ */
+#define LOADER_VENEER_BLOCK
+
+/**
+ * Section placement map
+ *
+ * Optional. Returns the ELFPlacement_t that maps sections to memory regions
+ * (for example hot code to CCM/TCM with SRAM as fallback, large .rodata to
+ * SDRAM). The map must live as long as the loaded modules. If not defined,
+ * or NULL, .sdram* sections go to #LOADER_ALIGN_ALLOC_SDRAM and everything
+ * else to #LOADER_ALIGN_ALLOC
+ *
+ * @param userdata
+ * @retval const ELFPlacement_t pointer
+ */
+#define LOADER_PLACEMENT
+
+/**
+ * Exported symbol index
+ *
+ * If defined, a hash index of the global functions and objects of the module
+ * is built in RAM after relocation. #get_func and #get_obj then take one
+ * probe instead of a scan of the symbol table
+ */
+#define LOADER_SYMBOL_INDEX
+
+/**
+ * Close module file after load
+ *
+ * If defined along with #LOADER_SYMBOL_INDEX, the file is closed as soon
+ * as loading ends, since #get_func and #get_obj don't need it. Other
+ * #get_sym lookups (STT_NOTYPE...) then fail, unless the module was loaded
+ * with #LOADER_METADATA_KEEP or by #load_elf_from_buffer. Otherwise the file
+ * stays open until #unload_elf
+ */
+#define LOADER_CLOSE_AFTER_LOAD
+
+/**
+ * Flash programming function
+ *
+ * If defined, #install_elf and #boot_elf are available. Called with
+ * increasing addresses inside the install target, except for the header at
+ * its start: that is written last, as the commit record that makes the
+ * install valid. Erasing the target before install is up to the host
+ *
+ * @param userdata
+ * @param addr Flash address
+ * @param src Data to program
+ * @param size Bytes to program
+ * @retval 0 On successful
+ */
+#define LOADER_FLASH_WRITE(userdata, addr, src, size)
+
+/**
+ * Host build ID
+ *
+ * Required by #LOADER_FLASH_WRITE and #LOADER_RELOC_CACHE_GET. Installed
+ * modules and cached relocations hold host symbol addresses, so this must
+ * change whenever the host firmware does (for example taken from the GNU
+ * build-id note). #boot_elf refuses images installed by another build
+ *
+ * @param userdata
+ * @retval uint32_t build ID
+ */
+#define LOADER_BUILD_ID(userdata)
+
+/**
+ * Relocation cache lookup
+ *
+ * If defined, relocated section contents are kept in a host provided
+ * persistent cache. When a module is loaded again at the same section
+ * addresses by the same host build (#LOADER_BUILD_ID), with its imports
+ * resolving to the same addresses, relocation is replaced by a copy from
+ * the cache entry. The module is still read and its imports resolved to
+ * check nothing changed
+ *
+ * @param userdata
+ * @param key uint32_t key of the module, from a digest of its contents
+ * @retval const void pointer to the entry stored for key, or NULL
+ */
+#define LOADER_RELOC_CACHE_GET(userdata, key)
+
+/**
+ * Relocation cache store
+ *
+ * Required by #LOADER_RELOC_CACHE_GET. Called after a load that missed
+ * the cache; data is released on return, so it must be copied. A new
+ * entry replaces any previous one of the same key
+ *
+ * @param userdata
+ * @param key uint32_t key of the module
+ * @param data Entry to store (word aligned)
+ * @param size Entry size in bytes
+ */
+#define LOADER_RELOC_CACHE_PUT(userdata, key, data, size)
+
+/**
+ * Symbol name read size
+ *
+ * Symbol names not held in memory are read and compared in pieces of this
+ * many bytes of stack (default 16)
+ */
+#define LOADER_NAME_CHUNK
+
+/**
+ * Import by ordinal resolver
+ *
+ * Used for modules carrying an .elfloader.imports section
+ * (tools/mkimports.py)
+ *
+ * @param userdata
+ * @param abi Hash of host ABI version the module was built against
+ * @param ordinal Index of symbol in host ABI
+ * @retval address of symbol, 0xffffffff if not resolved or ABI mismatch
+ */
+#define LOADER_GETIMPORTADDR(userdata, abi, ordinal)
+
 /**
  * Userdata descriptor type macro
  *
@@ -267,6 +522,29 @@ extern void arch_jumpTo(entry_t entry);
  */
 #define LOADER_FREE(ptr)
 
+/**
+ * Copy memory
+ *
+ * Used to copy section data out of in-memory images. Optional, a byte loop
+ * is used if not defined
+ *
+ * @param dst Destination buffer
+ * @param src Source buffer
+ * @param size Number of bytes to copy
+ */
+#define LOADER_MEMCPY(dst, src, size)
+
+/**
+ * Clear memory
+ *
+ * Used to zero .bss and the tail of loaded segments. Optional, a byte loop
+ * is used if not defined
+ *
+ * @param ptr Buffer to clear
+ * @param size Number of bytes to clear
+ */
+#define LOADER_CLEAR(ptr, size)
+
 /**
  * Compare string
  *
@@ -288,6 +566,40 @@ extern void arch_jumpTo(entry_t entry);
  */
 #define LOADER_JUMP_TO(entry)
 
+/**
+ * Call PIC code
+ *
+ * Optional. Used instead of #LOADER_JUMP_TO for entry point and init/fini
+ * arrays of linked modules with a GOT (built -msingle-pic-base
+ * -mpic-register=r9): loads base into r9 and calls entry, keeping the host
+ * r9. Without it PIC modules must not rely on r9 being set
+ *
+ * @param entry Pointer to function code to execute
+ * @param base PIC base (GOT address), see #get_pic_base
+ */
+#define LOADER_CALL_PIC(entry, base)
+
+/**
+ * Lazy binding entry
+ *
+ * Optional. If defined, imports a module only calls (BL or B.W, no address
+ * taken) are not resolved at load: their call sites go to a stub that
+ * enters this code on first call with IP (r12) pointing into the stub.
+ * It has to keep r0-r3 and LR, call #elf_lazy_bind with IP and tail call
+ * the returned address. NULL means the import can't be resolved: it must
+ * not be called, the code has to report the error and stop. Stubs are 28
+ * bytes, allocated from the region of the calling code. Modules loaded
+ * from a file keep it open while loaded
+ */
+#define LOADER_LAZY_ENTRY
+
+/**
+ * Lazy binding stubs per block
+ *
+ * Stubs are allocated in blocks of this many (default 8)
+ */
+#define LOADER_LAZY_BLOCK
+
 /**
  * Debug macro
  *
@@ -329,23 +641,163 @@ typedef struct {
   void *ptr; /*!< Pointer of symbol in memory */
 } ELFSymbol_t;
 
+/**
+ * Hash index slot of exported symbols
+ */
+typedef struct {
+  uint16_t symbol; /*!< Index in exported array plus one, 0 if slot is free */
+  uint16_t hash; /*!< Upper bits of #elf_name_hash of symbol name */
+} ELFSymbolIndex_t;
+
+/**
+ * Node of exported names trie
+ *
+ * Name of a node is the name of its parent followed by its label
+ */
+typedef struct {
+  uint16_t parent; /*!< Parent node, 0 is the root */
+  uint16_t label; /*!< Offset of label in labels pool */
+  uint8_t length; /*!< Label length */
+} ELFTrieNode_t;
+
+/**
+ * Flash resident export table generated by tools/mkexports.py
+ *
+ * Minimal perfect hash: slot = elf_name_hash_seed(name, disp[bucket]) % size
+ * with bucket = elf_name_hash(name) % buckets
+ */
+typedef struct ELFExportTable {
+  unsigned int size; /*!< Number of exports (and slots) */
+  unsigned int buckets; /*!< Number of displacement buckets */
+  const uint16_t *disp; /*!< Seed of each bucket */
+  const uint16_t *node; /*!< Trie node holding the name of each slot */
+  void * const *ptr; /*!< Address of each slot */
+  const ELFTrieNode_t *nodes; /*!< Names trie */
+  const char *labels; /*!< Trie labels pool */
+} ELFExportTable_t;
+
+/**
+ * Frozen version of host ABI
+ */
+typedef struct {
+  unsigned int count; /*!< Ordinals defined by this version */
+  uint32_t hash; /*!< Hash of the names of those ordinals */
+} ELFAbiVersion_t;
+
+/**
+ * Host ABI for ordinal imports, generated by tools/mkimports.py
+ */
+typedef struct ELFAbi {
+  void * const *ptr; /*!< Address of each ordinal */
+  unsigned int size; /*!< Number of ordinals */
+  const ELFAbiVersion_t *versions; /*!< Versions accepted from modules */
+  unsigned int versions_size; /*!< Elements on versions array */
+} ELFAbi_t;
+
 /**
  * Environment for execution
  */
 typedef struct ELFEnv {
   const ELFSymbol_t *exported; /*!< Pointer to exported symbols array */
   unsigned int exported_size; /*!< Elements on exported symbol array */
+  const ELFSymbolIndex_t *index; /*!< Optional hash index, see #initEnvIndex */
+  unsigned int index_size; /*!< Slots in index (power of two) */
+  const ELFExportTable_t *table; /*!< Optional generated export table */
+  const ELFAbi_t *abi; /*!< Optional host ABI for ordinal imports */
+  const ELFPlacement_t *placement; /*!< Optional section placement map */
+  uint32_t build_id; /*!< Firmware build ID, see #LOADER_BUILD_ID */
 } ELFEnv_t;
 
-static uint32_t getUndefinedSymbol(LOADER_USERDATA_T *userdata, const char *sName) {
+static int exportNameEq(const ELFExportTable_t *t, unsigned int node,
+    const ELFName_t *name, size_t len) {
+  while (node) {
+    const ELFTrieNode_t *n = &t->nodes[node];
+    if (n->length > len)
+      return 0;
+    len -= n->length;
+    if (!elf_name_eq_at(name, len, t->labels + n->label, n->length))
+      return 0;
+    node = n->parent;
+  }
+  return len == 0;
+}
+
+/**
+ * Build hash index of exported symbols
+ *
+ * Call once at boot. Lookups of undefined symbols then take one probe in
+ * the common case instead of a scan of the whole exported array.
+ *
+ * @param env Environment to index
+ * @param slots Storage for the index
+ * @param size Number of slots, power of two greater than exported_size
+ * @retval 0 On successful
+ */
+static inline int initEnvIndex(ELFEnv_t *env, ELFSymbolIndex_t *slots,
+    unsigned int size) {
+  unsigned int i, mask = size - 1;
+  if (!size || (size & mask) || size <= env->exported_size
+      || env->exported_size >= 0xffff)
+    return -1;
+  for (i = 0; i < size; i++)
+    slots[i].symbol = 0;
+  for (i = 0; i < env->exported_size; i++) {
+    uint32_t h = elf_name_hash(env->exported[i].name);
+    unsigned int slot = h & mask;
+    while (slots[slot].symbol)
+      slot = (slot + 1) & mask;
+    slots[slot].symbol = i + 1;
+    slots[slot].hash = h >> 16;
+  }
+  env->index = slots;
+  env->index_size = size;
+  return 0;
+}
+
+static uint32_t getUndefinedSymbol(LOADER_USERDATA_T *userdata,
+    const ELFName_t *sName) {
   const ELFEnv_t *env = userdata->env;
   int i;
-  for (i = 0; i < env->exported_size; i++)
-    if (LOADER_STREQ(env->exported[i].name, sName))
-      return (uint32_t) (env->exported[i].ptr);
-  DBG("  Can not find address for symbol %s\n", sName);
+  if (env->table) {
+    const ELFExportTable_t *t = env->table;
+    size_t len;
+    uint32_t b = elf_name_hash_stream(sName, 0, &len) % t->buckets;
+    uint32_t slot = elf_name_hash_stream(sName, t->disp[b], NULL) % t->size;
+    if (exportNameEq(t, t->node[slot], sName, len))
+      return (uint32_t) (t->ptr[slot]);
+  } else if (env->index) {
+    uint32_t h = elf_name_hash_stream(sName, 0, NULL);
+    unsigned int mask = env->index_size - 1;
+    unsigned int slot = h & mask;
+    while (env->index[slot].symbol) {
+      const ELFSymbol_t *sym = &env->exported[env->index[slot].symbol - 1];
+      if (env->index[slot].hash == (h >> 16) && elf_name_eq(sName, sym->name))
+        return (uint32_t) (sym->ptr);
+      slot = (slot + 1) & mask;
+    }
+  } else {
+    for (i = 0; i < env->exported_size; i++)
+      if (elf_name_eq(sName, env->exported[i].name))
+        return (uint32_t) (env->exported[i].ptr);
+  }
+  DBG("  Can not find address for symbol at %08X\n", sName->offset);
   return 0xffffffff;
 }
 
+static uint32_t getImportSymbol(LOADER_USERDATA_T *userdata, uint32_t abiHash,
+    uint32_t ordinal) {
+  const ELFAbi_t *abi = userdata->env->abi;
+  unsigned int i;
+  if (abi) {
+    for (i = 0; i < abi->versions_size; i++)
+      if (abi->versions[i].hash == abiHash) {
+        if (ordinal < abi->versions[i].count)
+          return (uint32_t) (abi->ptr[ordinal]);
+        break;
+      }
+  }
+  DBG("  Can not import ordinal %d of ABI %08X\n", ordinal, abiHash);
+  return 0xffffffff;
+}
 
 #endif /* LOADER_CONFIG_H_ */
@@ -33,6 +33,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <malloc.h>
+#include <string.h>
 
 #include "loader.h"
 #include "loader_config.h"
@@ -41,11 +42,15 @@
 #define APP_PATH
 //#define APP_NAME "app/app-striped.elf"
 #define APP_NAME "app-cpp/app-cpp-striped.elf"
+/* Written along with APP_NAME by "make COMPACT=1" in app-cpp */
+#define APP_COMPACT_NAME "app-cpp/app-cpp.bin"
+/* Static object of app-cpp, not in the symbol index */
+#define APP_LOCAL_OBJ "_ZL9test_data"
 #define APP_STACK_SIZE 1048
 
 extern int open(const char *path, int mode, ...);
 
-static const sysent_t sysentries = { /* */
+const sysent_t sysentries = { /* */
 open, /* */
 close, /* */
 write, /* */
@@ -55,24 +60,254 @@ scanf /* */
 };
 
 static const ELFSymbol_t exports[] = { { "syscalls", (void*) &sysentries } };
-static const ELFEnv_t env = { exports, sizeof(exports) / sizeof(*exports) };
+static ELFEnv_t env = { exports, sizeof(exports) / sizeof(*exports) };
+static ELFSymbolIndex_t exports_index[2];
+
+#ifdef LOADER_EXPORT_TABLE
+/* Generated from host/exports.txt by "make exports" */
+extern const ELFExportTable_t export_table;
+#endif
+
+#ifdef LOADER_ABI_TABLE
+/* Generated from host/abi.txt by "make abi" */
+extern const ELFAbi_t abi_table;
+#endif
+
+/*
+ * Report one check of the sample runs
+ */
+static int check(const char *what, int ok) {
+  printf("%s: %s\n", what, ok ? "ok" : "FAILED");
+  return ok ? 0 : -1;
+}
+
+/*
+ * Run the entry point and then doit() of a loaded module
+ */
+static void run_elf(ELFExec_t *exec) {
+  jumpTo(exec);
+  void (*doit)(void) = get_func(exec, "doit");
+  if (doit) {
+    (doit)();
+  }
+}
 
 static int exec_elf(const char *path, const ELFEnv_t *env) {
   ELFExec_t *exec;
   loader_env_t loader_env;
   loader_env.env = env;
-  load_elf(path, loader_env, &exec);
-  int ret = jumpTo(exec);
-  void (*doit)(void) = get_func(exec, "doit");
-  if (doit) {
-    (doit)();
+  if (load_elf(path, loader_env, &exec) != 0) {
+    printf("Load %s failed\n", path);
+    return -1;
+  }
+  run_elf(exec);
+  unload_elf(exec);
+  return 0;
+}
+
+/*
+ * The compact conversion of the app loads in one pass and runs like the
+ * ELF module, with its exported names in the symbol index
+ */
+static void run_compact(const char *path, const ELFEnv_t *env) {
+  ELFExec_t *exec;
+  loader_env_t loader_env;
+  loader_env.env = env;
+  if (load_elf(path, loader_env, &exec) != 0) {
+    printf("No compact module at %s\n", path);
+    return;
+  }
+#ifdef LOADER_SYMBOL_INDEX
+  check("Compact index lookup", get_func(exec, "doit") != NULL);
+#endif
+  run_elf(exec);
+  unload_elf(exec);
+}
+
+#ifdef LOADER_SYMBOL_INDEX
+/*
+ * Exported names are found through the symbol index, the others (like
+ * static objects) by the symbol table scan it falls back to
+ */
+static void check_symbols(const char *path, const ELFEnv_t *env) {
+  ELFExec_t *exec;
+  loader_env_t loader_env;
+  loader_env.env = env;
+  if (load_elf(path, loader_env, &exec) != 0) {
+    printf("Load %s failed\n", path);
+    return;
   }
+  check("Index lookup", get_func(exec, "doit") != NULL);
+#if !defined(LOADER_CLOSE_AFTER_LOAD) || defined(LOADER_METADATA_KEEP)
+  const char *local = get_obj(exec, APP_LOCAL_OBJ);
+  check("Symbol table lookup", local && local[0] == 10);
+#endif
+  check("Missing symbol", get_func(exec, "no_such_symbol") == NULL);
   unload_elf(exec);
+}
+#endif
+
+#ifdef LOADER_FLASH_WRITE
+/* Flash stand-in: the sample installs modules to RAM */
+static uint8_t flash[16384] __attribute__((aligned(8)));
+static uint8_t flash_ram[4096] __attribute__((aligned(8)));
+
+int flash_write(uint32_t addr, const void *src, size_t size) {
+  memcpy((void *) (uintptr_t) addr, src, size);
   return 0;
 }
 
+/*
+ * Install the module and boot it, then check that boot_elf rejects the
+ * image when a word of its header is erased or the slot is too small
+ */
+static void run_installed(const char *path, const ELFEnv_t *env) {
+  ELFInstall_t slot = { (uintptr_t) flash, sizeof(flash), flash_ram,
+      sizeof(flash_ram) };
+  ELFInstall_t small;
+  ELFExec_t *exec;
+  uint32_t *word = (uint32_t *) flash;
+  uint32_t saved;
+  int i, rejected = 0;
+  loader_env_t loader_env;
+  loader_env.env = env;
+  if (check("Install", install_elf(path, loader_env, &slot) == 0) != 0)
+    return;
+  if (check("Boot", boot_elf(&slot, loader_env, &exec) == 0) != 0)
+    return;
+  run_elf(exec);
+  unload_elf(exec);
+  for (i = 0; i < 16; i++) {
+    saved = word[i];
+    word[i] = 0xffffffff;
+    rejected += boot_elf(&slot, loader_env, &exec) != 0;
+    word[i] = saved;
+  }
+  check("Boot erased header words", rejected == 16);
+  small = slot;
+  small.flash_size = sizeof(ELFInstall_t);
+  check("Boot truncated image", boot_elf(&small, loader_env, &exec) != 0);
+  small = slot;
+  small.ram_size = 0;
+  check("Boot without RAM block", boot_elf(&small, loader_env, &exec) != 0);
+}
+#endif
+
+#ifdef LOADER_RELOC_CACHE_GET
+/* Relocation cache stand-in: one entry in RAM */
+static void *reloc_cache;
+static uint32_t reloc_cache_key;
+static unsigned int reloc_cache_stores;
+
+const void *reloc_cache_get(uint32_t key) {
+  return reloc_cache && key == reloc_cache_key ? reloc_cache : NULL;
+}
+
+void reloc_cache_put(uint32_t key, const void *data, size_t size) {
+  free(reloc_cache);
+  reloc_cache = malloc(size);
+  if (reloc_cache)
+    memcpy(reloc_cache, data, size);
+  reloc_cache_key = key;
+  reloc_cache_stores++;
+}
+
+/*
+ * A copy loaded while another one is in memory lands at other addresses:
+ * it must miss the cache and store a new entry. Loading again after
+ * unloading it may hit, but only at the same addresses
+ */
+static void run_cached(const char *path, const ELFEnv_t *env) {
+  ELFExec_t *first, *moved;
+  void *moved_doit;
+  unsigned int stores;
+  int hit;
+  loader_env_t loader_env;
+  loader_env.env = env;
+  if (load_elf(path, loader_env, &first) != 0) {
+    printf("Load %s failed\n", path);
+    return;
+  }
+  stores = reloc_cache_stores;
+  if (load_elf(path, loader_env, &moved) == 0) {
+    check("Cache miss on moved sections", reloc_cache_stores == stores + 1);
+    run_elf(moved);
+    moved_doit = get_func(moved, "doit");
+    unload_elf(moved);
+    stores = reloc_cache_stores;
+    if (load_elf(path, loader_env, &moved) == 0) {
+      hit = reloc_cache_stores == stores;
+      printf("Reload: cache %s\n", hit ? "hit" : "miss");
+      check("Cache hit at the same addresses",
+          !hit || get_func(moved, "doit") == moved_doit);
+      run_elf(moved);
+      unload_elf(moved);
+    }
+  }
+  unload_elf(first);
+}
+#endif
+
+#ifdef LOADER_INCREMENTAL
+/*
+ * Load and run the module with load_step calls of the given budget,
+ * returns the number of calls or -1
+ */
+static int step_elf(const char *path, const ELFEnv_t *env,
+    unsigned int budget) {
+  ELFExec_t *exec;
+  int ret, steps = 0;
+  loader_env_t loader_env;
+  loader_env.env = env;
+  if (load_begin(path, loader_env, &exec) != 0)
+    return -1;
+  do {
+    ret = load_step(exec, budget);
+    steps++;
+  } while (ret > 0);
+  if (ret < 0 || load_finish(exec) != 0)
+    return -1;
+  run_elf(exec);
+  unload_elf(exec);
+  return steps;
+}
+
+/*
+ * load_step only returns before its budget is used up when the load is
+ * done, so with budget 1 the calls count the units of work of the load
+ * and budget n takes that count divided by n, rounded up
+ */
+static void run_incremental(const char *path, const ELFEnv_t *env) {
+  int units = step_elf(path, env, 1);
+  int steps = step_elf(path, env, 7);
+  printf("Incremental load: %d units, %d steps of 7\n", units, steps);
+  check("Step budget", units > 0 && steps == (units + 6) / 7);
+}
+#endif
+
 int main(void) {
+#ifdef LOADER_EXPORT_TABLE
+  env.table = &export_table;
+#else
+  initEnvIndex(&env, exports_index, sizeof(exports_index) / sizeof(*exports_index));
+#endif
+#ifdef LOADER_ABI_TABLE
+  env.abi = &abi_table;
+#endif
   exec_elf(APP_PATH APP_NAME, &env);
+  run_compact(APP_PATH APP_COMPACT_NAME, &env);
+#ifdef LOADER_SYMBOL_INDEX
+  check_symbols(APP_PATH APP_NAME, &env);
+#endif
+#ifdef LOADER_FLASH_WRITE
+  run_installed(APP_PATH APP_NAME, &env);
+#endif
+#ifdef LOADER_RELOC_CACHE_GET
+  run_cached(APP_PATH APP_NAME, &env);
+#endif
+#ifdef LOADER_INCREMENTAL
+  run_incremental(APP_PATH APP_NAME, &env);
+#endif
   puts("Done");
 }
 
@@ -118,6 +353,46 @@ void arch_jumpTo(entry_t entry) {
 #endif
 }
 
+/* r9 is callee saved in the AAPCS, PIC modules never change it */
+__attribute__((naked)) void arch_callPic(entry_t entry, void *base) {
+  __asm__ volatile(
+      "push {r9, lr}\n\t"
+      "mov r9, r1\n\t"
+      "blx r0\n\t"
+      "pop {r9, pc}\n\t");
+}
+
+#ifdef LOADER_LAZY_ENTRY
+/*
+ * Import of a running module not found on its first call: there is no
+ * way back into the module, so stop here
+ */
+void arch_lazyFail(void *ip, void *caller) {
+  printf("Unresolved lazy import, stub %p called from %p\n", ip, caller);
+  for (;;)
+    __asm__ volatile("bkpt");
+}
+
+/*
+ * First call of a lazy import: IP points into its stub. Keeps the call
+ * arguments and LR (plus IP, for 8 byte stack alignment), then tail calls
+ * the import, or traps in arch_lazyFail if it can't be resolved
+ */
+__attribute__((naked)) void arch_lazyEntry(void) {
+  __asm__ volatile(
+      "push {r0-r3, ip, lr}\n\t"
+      "mov r0, ip\n\t"
+      "bl elf_lazy_bind\n\t"
+      "cbz r0, 1f\n\t"
+      "str r0, [sp, #16]\n\t"
+      "pop {r0-r3, ip, lr}\n\t"
+      "bx ip\n"
+      "1:\n\t"
+      "ldrd r0, r1, [sp, #16]\n\t"
+      "bl arch_lazyFail\n\t");
+}
+#endif
+
 int is_streq(const char *s1, const char *s2) {
   while (*s1 && *s2) {
     if (*s1 != *s2)
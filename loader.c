@@ -35,40 +35,425 @@
 #include "loader_config.h"
 
 #define IS_FLAGS_SET(v, m) ((v&m) == m)
+#define ELF_IMPORTS_MAGIC 0x49464c45 /* "ELFI" */
+#define ELF_PLACEMENT_MAGIC 0x50464c45 /* "ELFP" */
+#define ELF_INSTALL_MAGIC 0x42464c45 /* "ELFB" */
+#define ELF_RELOC_CACHE_MAGIC 0x63464c45 /* "ELFc" */
+#define ELF_COMPACT_MAGIC 0x58464c45 /* "ELFX" */
 #define SECTION_OFFSET(e, n) (e->sectionTable + n * sizeof(Elf32_Shdr))
 
+#ifndef LOADER_REL_BATCH
+#define LOADER_REL_BATCH 16
+#endif
+
+#ifndef LOADER_NAME_CHUNK
+#define LOADER_NAME_CHUNK 16
+#endif
+
+#ifndef LOADER_VENEER_BLOCK
+#define LOADER_VENEER_BLOCK 8
+#endif
+
+#ifndef LOADER_LAZY_BLOCK
+#define LOADER_LAZY_BLOCK 8
+#endif
+
+#ifndef LOADER_STEP_BYTES
+#define LOADER_STEP_BYTES 256
+#endif
+
+#ifndef LOADER_MEMCPY
+#define LOADER_MEMCPY(dst, src, size) do { \
+    char *d = (char *) (dst); \
+    const char *s = (const char *) (src); \
+    size_t c = (size); \
+    while (c--) \
+      *d++ = *s++; \
+  } while (0)
+#endif
+
+#ifndef LOADER_CLEAR
+#define LOADER_CLEAR(ptr, size) do { \
+    char *p = (char *) (ptr); \
+    size_t c = (size); \
+    while (c--) \
+      *p++ = 0; \
+  } while (0)
+#endif
+
+#if defined(LOADER_FLASH_WRITE) && !defined(LOADER_SYMBOL_INDEX)
+#error "LOADER_FLASH_WRITE needs LOADER_SYMBOL_INDEX"
+#endif
+
+#if defined(LOADER_RELOC_CACHE_GET) && !defined(LOADER_BUILD_ID)
+#error "LOADER_RELOC_CACHE_GET needs LOADER_BUILD_ID"
+#endif
+
+#if defined(LOADER_STREAM) && !defined(LOADER_METADATA_CACHE)
+#error "LOADER_STREAM needs LOADER_METADATA_CACHE"
+#endif
+
+#ifdef LOADER_STREAM
+#define IS_STREAM(e) ((e)->stream)
+#else
+#define IS_STREAM(e) 0
+#endif
+
+#ifdef LOADER_INCREMENTAL
+#define IS_STEPPED(e) ((e)->stepPhase != StepNone)
+#else
+#define IS_STEPPED(e) 0
+#endif
+
 #ifndef DOX
 
+typedef enum {
+  SecData = 0,
+  SecInitArray,
+  SecFiniArray
+} ELFSecKind_t;
+
+/*
+ * Loaded section, indexed by ELF section number
+ */
 typedef struct {
   void *data;
-  int secIdx;
-  off_t relSecIdx;
+  Elf32_Addr addr; /* run time address, only differs from data on install */
+  Elf32_Word size;
+  Elf32_Half relSecIdx;
+  uint8_t kind;
+  uint8_t region;
+  uint8_t align; /* log2 of sh_addralign */
+  uint8_t perm;
+  uint8_t xip; /* data points into the image */
 } ELFSection_t;
 
+#ifdef LOADER_METADATA_CACHE
+typedef struct {
+  off_t offset;
+  size_t size;
+  const char *data;
+} ELFMetaRange_t;
+
+typedef enum {
+  MetaSecHdrs = 0,
+  MetaSecStrings,
+  MetaSymbols,
+  MetaSymStrings,
+  MetaRanges
+} ELFMetaIdx_t;
+#endif
+
+#ifdef LOADER_BLOCK_CACHE_BLOCKS
+#ifndef LOADER_BLOCK_CACHE_SIZE
+#define LOADER_BLOCK_CACHE_SIZE 512
+#endif
+#if LOADER_BLOCK_CACHE_BLOCKS < 2
+#error "LOADER_BLOCK_CACHE_BLOCKS must be at least 2"
+#endif
+
+typedef struct {
+  off_t offset;
+  size_t valid;
+  unsigned int used;
+} ELFCacheBlock_t;
+#endif
+
+#ifdef LOADER_SYMBOL_INDEX
+typedef struct {
+  uint32_t hash;
+  Elf32_Addr addr;
+  uint32_t name;
+} ELFSymIndexSlot_t;
+#endif
+
+#ifdef LOADER_FLASH_WRITE
+/*
+ * Installed image: this header, one ELFInstallSection_t per ELF section,
+ * the flash resident sections, the initial RAM data and the symbol index.
+ * Offsets are from the start of the image
+ */
+typedef struct {
+  Elf32_Word magic;
+  Elf32_Word buildId;
+  Elf32_Word size;
+  Elf32_Word sections;
+  Elf32_Word textIdx;
+  Elf32_Word entry;
+  Elf32_Word code;
+  Elf32_Word codeSize;
+  Elf32_Addr ram;
+  Elf32_Word data;
+  Elf32_Word dataSize;
+  Elf32_Word bssStart; /* from ram */
+  Elf32_Word bssSize;
+  Elf32_Word symIndex;
+  Elf32_Word symIndexSize;
+} ELFInstallHeader_t;
+
+typedef struct {
+  Elf32_Addr addr;
+  Elf32_Word size;
+  Elf32_Word kind;
+} ELFInstallSection_t;
+
+typedef enum {
+  InstallData = 0,
+  InstallBss,
+  InstallFlash,
+  InstallRegions
+} ELFInstallRegion_t;
+#endif
+
+/*
+ * Compact load format, see tools/mkcompact.py: this header, segment
+ * descriptors, arrays, imports, names, segment data, one relocation stream
+ * per segment and the symbol index
+ */
+typedef struct {
+  Elf32_Word magic;
+  Elf32_Word abiHash;
+  Elf32_Word segments;
+  Elf32_Word arrays;
+  Elf32_Word imports;
+  Elf32_Word namesSize;
+  Elf32_Word entrySeg;
+  Elf32_Word entry;
+  Elf32_Word indexSlots;
+  Elf32_Word indexNames;
+} ELFCompactHeader_t;
+
+typedef struct {
+  Elf32_Word name;
+  Elf32_Word size;
+  Elf32_Word fileSize;
+  Elf32_Word align; /* log2 */
+  Elf32_Word perm;
+  Elf32_Word relocs;
+} ELFCompactSegment_t;
+
+typedef struct {
+  Elf32_Word kind;
+  Elf32_Word seg;
+  Elf32_Word offset;
+  Elf32_Word size;
+} ELFCompactArray_t;
+
+#define COMPACT_IMPORT_ORDINAL 0x80000000u
+#define COMPACT_REL_TYPE(w) ((w) & 0xff)
+#define COMPACT_REL_ARG(w) (((w) >> 8) & 0xfff)
+#define COMPACT_REL_DELTA(w) (((w) >> 20) << 1)
+#define COMPACT_REL_ADDEND 0xfff /* control arg: next word is the addend */
+
+/*
+ * Load map of a linked module: where each PT_LOAD segment runs. Segments
+ * loaded to RAM share one block, read-only ones of an XIP image each run
+ * in place
+ */
+typedef struct {
+  Elf32_Addr addr; /* run time address */
+  Elf32_Addr vaddr; /* module address */
+  Elf32_Word memsz;
+} ELFLoadSegment_t;
+
+/* Sections of a linked module */
+enum {
+  LinkedRam = 1, /* block of the segments loaded to RAM */
+  LinkedInit,
+  LinkedFini,
+  LinkedSections
+};
+
+/* Relocated fields, see relHowto */
+typedef enum {
+  FieldUnsupported = 0,
+  FieldNone, /* nothing to patch */
+  FieldWord,
+  FieldPrel31, /* bits 0-30, bit 31 kept */
+  FieldHalf,
+  FieldByte,
+  FieldThmCall, /* BL, B.W: +-16 MB */
+  FieldThmJump19, /* B<c>.W: +-1 MB */
+  FieldThmJump11, /* B: +-2 KB */
+  FieldThmJump8, /* B<c>: +-256 bytes */
+  FieldThmMovw, /* low half of the result */
+  FieldThmMovt, /* high half of the result */
+  FieldThmPc8, /* LDR literal, ADR: 0 to 1020 bytes, word aligned */
+  FieldThmPc12, /* LDR.W literal: +-4095 bytes */
+  FieldGot /* the value in place is not an addend */
+} ELFRelField_t;
+
+#define REL_PC 1 /* result is S + A - P */
+#define REL_PC_ALIGN 2 /* result is S + A - (P & ~3) */
+#define REL_CHECK 4 /* result must fit the field */
+
+typedef struct {
+  uint8_t field; /* ELFRelField_t */
+  uint8_t flags;
+} ELFRelHowto_t;
+
+/*
+ * Island of far branch veneers, allocated from the region of the code that
+ * branches to them. Each veneer is LDR.W PC, [PC, #0] and the target word
+ */
+typedef struct ELFVeneerIsland {
+  struct ELFVeneerIsland *next;
+  uint16_t region;
+  uint16_t count;
+  Elf32_Word code[2 * LOADER_VENEER_BLOCK];
+} ELFVeneerIsland_t;
+
+#define VENEER_LDR_PC 0xf000f8df /* LDR.W PC, [PC, #0] */
+
+#ifdef LOADER_LAZY_ENTRY
+/*
+ * Lazy binding stub of an import: a veneer whose target is first the bind
+ * code below it, which enters LOADER_LAZY_ENTRY with IP pointing 12 bytes
+ * into the stub. elf_lazy_bind() then stores the import in target
+ */
+typedef struct {
+  Elf32_Word jump; /* LDR.W PC, [PC, #0] */
+  Elf32_Addr target;
+  Elf32_Word bind[2]; /* MOV IP, PC; LDR.W PC, [PC, #4]; NOP */
+  Elf32_Addr entry; /* LOADER_LAZY_ENTRY */
+  struct ELFExec *exec;
+  Elf32_Word sym;
+} ELFLazyStub_t;
+
+#define LAZY_BIND_0 0xf8df46fc /* MOV IP, PC; LDR.W PC, ... */
+#define LAZY_BIND_1 0xbf00f004 /* ... [PC, #4]; NOP */
+#define LAZY_STUB_IP 12 /* IP - stub in LOADER_LAZY_ENTRY */
+
+typedef struct ELFLazyBlock {
+  struct ELFLazyBlock *next;
+  uint16_t region;
+  uint16_t count;
+  ELFLazyStub_t stub[LOADER_LAZY_BLOCK];
+} ELFLazyBlock_t;
+#endif
+
+#ifdef LOADER_INCREMENTAL
+typedef enum {
+  StepNone = 0, /* not an incremental load */
+  StepHeaders,
+  StepMetadata,
+  StepPlace,
+  StepData,
+  StepRelocate,
+  StepIndex,
+  StepDone
+} ELFStepPhase_t;
+#endif
+
+/* Entry n of a batch of Elf32_Rel or Elf32_Rela, both start the same */
+#define REL_ENTRY(rel, n, size) \
+  ((const Elf32_Rel *) ((const char *) (rel) + (n) * (size)))
+#define REL_SIZE(h) \
+  ((h)->sh_type == SHT_RELA ? sizeof(Elf32_Rela) : sizeof(Elf32_Rel))
+
+#ifdef LOADER_RELOC_CACHE_GET
+/*
+ * Relocation cache entry: this header, then for each loaded section an
+ * ELFRelocCacheSection_t followed by its relocated bytes (word padded).
+ * Sections without relocations are recorded with no bytes, only so their
+ * addresses are checked: code referencing them holds their addresses
+ */
+typedef struct {
+  Elf32_Word magic;
+  Elf32_Word digest[2];
+  Elf32_Word buildId;
+  Elf32_Word count;
+  Elf32_Word size;
+} ELFRelocCacheHeader_t;
+
+typedef struct {
+  Elf32_Word sec;
+  Elf32_Addr addr;
+  Elf32_Word size;
+  Elf32_Word bytes;
+} ELFRelocCacheSection_t;
+#endif
+
 typedef struct ELFExec {
 
   LOADER_USERDATA_T user_data;
 
+  const char *image;
+  size_t imageSize;
+  int xip;
+#ifdef LOADER_STREAM
+  int stream;
+  off_t streamPos;
+#endif
+
+#ifdef LOADER_METADATA_CACHE
+  char *meta;
+  ELFMetaRange_t metaRange[MetaRanges];
+#endif
+
+#ifdef LOADER_BLOCK_CACHE_BLOCKS
+  char *cacheData;
+  ELFCacheBlock_t cacheBlock[LOADER_BLOCK_CACHE_BLOCKS];
+  unsigned int cacheTick;
+  unsigned int cacheHits;
+  unsigned int cacheMisses;
+#endif
+
   size_t sections;
   off_t sectionTable;
   off_t sectionTableStrings;
 
+  size_t segments;
+  off_t segmentTable;
+  ELFLoadSegment_t *loadMap;
+  size_t loadMapSize;
+  Elf32_Addr picBase;
+
+  ELFVeneerIsland_t *veneers;
+#ifdef LOADER_LAZY_ENTRY
+  ELFLazyBlock_t *lazy;
+  uint32_t *symLazy;
+#endif
+
   size_t symbolCount;
   off_t symbolTable;
   off_t symbolTableStrings;
-  off_t entry;
 
-  ELFSection_t text;
-  ELFSection_t rodata;
-  ELFSection_t data;
-  ELFSection_t bss;
-  ELFSection_t init_array;
-  ELFSection_t fini_array;
-  ELFSection_t sdram_rodata;
-  ELFSection_t sdram_data;
-  ELFSection_t sdram_bss;
+  Elf32_Addr *symAddr;
+  uint32_t *symResolved;
 
-  unsigned int fini_array_size;
+  off_t importsOffset;
+  size_t importsSize;
+  off_t manifestOffset;
+  size_t manifestSize;
+
+#ifdef LOADER_SYMBOL_INDEX
+  ELFSymIndexSlot_t *symIndex;
+  size_t symIndexSize;
+  size_t symIndexNames;
+  int fileClosed;
+#endif
+#ifdef LOADER_FLASH_WRITE
+  const ELFInstall_t *install;
+  ELFInstallHeader_t installHeader;
+  int installed;
+#endif
+#ifdef LOADER_RELOC_CACHE_GET
+  Elf32_Word relocDigest[2];
+#endif
+#ifdef LOADER_INCREMENTAL
+  ELFStepPhase_t stepPhase;
+  int stepSection;
+  size_t stepPos;
+  int stepShStrIdx;
+#endif
+  off_t entry;
+  int textIdx;
+  int strTabIdx;
+
+  ELFSection_t *section;
+  const ELFPlacement_t *placement;
+  void **region;
 
 } ELFExec_t;
 
@@ -80,56 +465,351 @@ typedef enum {
   FoundSymTab = (1 << 0),
   FoundStrTab = (1 << 2),
   FoundText = (1 << 3),
-  FoundRodata = (1 << 4),
-  FoundData = (1 << 5),
-  FoundBss = (1 << 6),
-  FoundRelText = (1 << 7),
-  FoundRelRodata = (1 << 8),
-  FoundRelData = (1 << 9),
-  FoundRelBss = (1 << 10),
-  FoundInitArray = (1 << 11),
-  FoundRelInitArray = (1 << 12),
-  FoundFiniArray = (1 << 13),
-  FoundRelFiniArray = (1 << 14),
-  FoundSDRamRodata = (1 << 15),
-  FoundSDRamData = (1 << 16),
-  FoundSDRamBss = (1 << 17),
-  FoundRelSDRamRodata = (1 << 18),
-  FoundRelSDRamData = (1 << 19),
-  FoundRelSDRamBss = (1 << 20),
   FoundValid = FoundSymTab | FoundStrTab,
-  FoundExec = FoundValid | FoundText,
-  FoundAll = FoundSymTab | FoundStrTab | FoundText | FoundRodata | FoundData
-      | FoundBss | FoundRelText | FoundRelRodata | FoundRelData | FoundRelBss
-      | FoundInitArray | FoundRelInitArray
-      | FoundFiniArray | FoundRelFiniArray
+  FoundExec = FoundValid | FoundText
 } FindFlags_t;
 
-static int readSectionName(ELFExec_t *e, off_t off, char *buf, size_t max) {
-  int ret = -1;
-  off_t offset = e->sectionTableStrings + off;
-  off_t old = LOADER_TELL(e->user_data);
-  if (LOADER_SEEK_FROM_START(e->user_data, offset) == 0)
-    if (LOADER_READ(e->user_data, buf, max) == 0)
-      ret = 0;
-  (void) LOADER_SEEK_FROM_START(e->user_data, old);
-  return ret;
+#ifdef LOADER_METADATA_CACHE
+static const char *metaSpan(ELFExec_t *e, off_t off, size_t *avail) {
+  int i;
+  for (i = 0; i < MetaRanges; i++) {
+    const ELFMetaRange_t *r = &e->metaRange[i];
+    if (r->data && off >= r->offset && (size_t) (off - r->offset) < r->size) {
+      *avail = r->size - (off - r->offset);
+      return r->data + (off - r->offset);
+    }
+  }
+  return NULL;
 }
 
-static int readSymbolName(ELFExec_t *e, off_t off, char *buf, size_t max) {
-  int ret = -1;
-  off_t offset = e->symbolTableStrings + off;
-  off_t old = LOADER_TELL(e->user_data);
-  if (LOADER_SEEK_FROM_START(e->user_data, offset) == 0)
-    if (LOADER_READ(e->user_data, buf, max) == 0)
-      ret = 0;
-  (void) LOADER_SEEK_FROM_START(e->user_data, old);
-  return ret;
+static const char *metaAt(ELFExec_t *e, off_t off, size_t size) {
+  size_t avail;
+  const char *p = metaSpan(e, off, &avail);
+  return p && size <= avail ? p : NULL;
+}
+#endif
+
+#ifdef LOADER_BLOCK_CACHE_BLOCKS
+static void initBlockCache(ELFExec_t *e) {
+  int i;
+  e->cacheData = LOADER_ALIGN_ALLOC(
+      LOADER_BLOCK_CACHE_BLOCKS * LOADER_BLOCK_CACHE_SIZE, 4,
+      ELF_SEC_READ | ELF_SEC_WRITE);
+  if (!e->cacheData)
+    MSG("No memory for block cache");
+  for (i = 0; i < LOADER_BLOCK_CACHE_BLOCKS; i++) {
+    e->cacheBlock[i].valid = 0;
+    e->cacheBlock[i].used = 0;
+  }
+}
+
+static void freeBlockCache(ELFExec_t *e) {
+  if (e->cacheData)
+    LOADER_FREE(e->cacheData);
+  e->cacheData = NULL;
+}
+
+/*
+ * Return pointer to cached file data at off, filling the least recently
+ * used block on miss. avail returns bytes valid from the pointer to the end
+ * of the block
+ */
+static const char *cacheBlockAt(ELFExec_t *e, off_t off, size_t *avail) {
+  off_t base = off - off % LOADER_BLOCK_CACHE_SIZE;
+  ELFCacheBlock_t *b = NULL, *victim = &e->cacheBlock[0];
+  char *data;
+  size_t n;
+  int i;
+  for (i = 0; i < LOADER_BLOCK_CACHE_BLOCKS; i++) {
+    if (e->cacheBlock[i].valid && e->cacheBlock[i].offset == base) {
+      b = &e->cacheBlock[i];
+      break;
+    }
+    if (e->cacheBlock[i].used < victim->used)
+      victim = &e->cacheBlock[i];
+  }
+  if (b) {
+    e->cacheHits++;
+  } else {
+    e->cacheMisses++;
+    b = victim;
+    b->valid = 0;
+    b->used = 0;
+    data = e->cacheData + (b - e->cacheBlock) * LOADER_BLOCK_CACHE_SIZE;
+    if (LOADER_SEEK_FROM_START(e->user_data, base) != 0)
+      return NULL;
+    n = LOADER_READ(e->user_data, data, LOADER_BLOCK_CACHE_SIZE);
+    if (n == 0 || n > LOADER_BLOCK_CACHE_SIZE)
+      return NULL;
+    b->offset = base;
+    b->valid = n;
+  }
+  b->used = ++e->cacheTick;
+  if ((size_t) (off - base) >= b->valid)
+    return NULL;
+  *avail = b->valid - (off - base);
+  return e->cacheData + (b - e->cacheBlock) * LOADER_BLOCK_CACHE_SIZE
+      + (off - base);
+}
+
+static const void *cacheRead(ELFExec_t *e, off_t off, void *buf, size_t size) {
+  char *dst = buf;
+  const char *p;
+  size_t avail;
+  if (size >= LOADER_BLOCK_CACHE_SIZE) {
+    /* Bulk section data: bypass cache to not evict metadata blocks */
+    if (LOADER_SEEK_FROM_START(e->user_data, off) != 0)
+      return NULL;
+    if (LOADER_READ(e->user_data, buf, size) != size)
+      return NULL;
+    return buf;
+  }
+  p = cacheBlockAt(e, off, &avail);
+  if (!p)
+    return NULL;
+  if (avail >= size)
+    return p;
+  while (size) {
+    size_t n = avail < size ? avail : size;
+    LOADER_MEMCPY(dst, p, n);
+    dst += n;
+    off += n;
+    size -= n;
+    if (size) {
+      p = cacheBlockAt(e, off, &avail);
+      if (!p)
+        return NULL;
+    }
+  }
+  return buf;
+}
+
+static const char *cacheString(ELFExec_t *e, off_t off, char *buf, size_t max) {
+  const char *p;
+  size_t avail, i, n = 0;
+  p = cacheBlockAt(e, off, &avail);
+  if (!p)
+    return NULL;
+  for (i = 0; i < avail; i++)
+    if (!p[i])
+      return p;
+  /* String crosses block boundary */
+  while (n < max - 1) {
+    for (i = 0; i < avail && n < max - 1; i++) {
+      buf[n++] = p[i];
+      if (!p[i])
+        return buf;
+    }
+    p = cacheBlockAt(e, off + n, &avail);
+    if (!p)
+      break;
+  }
+  if (!n)
+    return NULL;
+  buf[n] = 0;
+  return buf;
+}
+#endif
+
+#ifdef LOADER_STREAM
+/*
+ * A stream only goes forward: bytes up to off are read and dropped, going
+ * back is an error. Short reads are retried until size bytes arrive
+ */
+static const void *streamRead(ELFExec_t *e, off_t off, void *buf,
+    size_t size) {
+  char skip[LOADER_NAME_CHUNK];
+  char *p = buf;
+  if (off < e->streamPos) {
+    DBG("Stream read @ %08x, already at %08x\n", (unsigned int) off,
+        (unsigned int) e->streamPos);
+    return NULL;
+  }
+  while (e->streamPos < off || size) {
+    char *dst = p;
+    size_t want = size;
+    long n;
+    if (e->streamPos < off) {
+      dst = skip;
+      want = off - e->streamPos;
+      if (want > sizeof(skip))
+        want = sizeof(skip);
+    }
+    n = (long) LOADER_READ(e->user_data, dst, want);
+    if (n <= 0 || (size_t) n > want)
+      return NULL;
+    e->streamPos += n;
+    if (dst == p) {
+      p += n;
+      size -= n;
+    }
+  }
+  return buf;
+}
+#endif
+
+static const void *fileRead(ELFExec_t *e, off_t off, void *buf, size_t size) {
+#ifdef LOADER_STREAM
+  if (e->stream)
+    return streamRead(e, off, buf, size);
+#endif
+  if (LOADER_SEEK_FROM_START(e->user_data, off) != 0)
+    return NULL;
+  if (LOADER_READ(e->user_data, buf, size) != size)
+    return NULL;
+  return buf;
+}
+
+static const void *readAt(ELFExec_t *e, off_t off, void *buf, size_t size) {
+  if (e->image) {
+    if (off < 0 || (size_t) off > e->imageSize || size > e->imageSize - off)
+      return NULL;
+    return e->image + off;
+  }
+#ifdef LOADER_METADATA_CACHE
+  {
+    const char *p = metaAt(e, off, size);
+    if (p)
+      return p;
+  }
+#endif
+#ifdef LOADER_BLOCK_CACHE_BLOCKS
+  if (e->cacheData)
+    return cacheRead(e, off, buf, size);
+#endif
+  return fileRead(e, off, buf, size);
+}
+
+/*
+ * Pointers returned by readAt() into the block cache are valid until a
+ * block is evicted. Use this for data that must survive further reads
+ */
+static const void *readPinned(ELFExec_t *e, off_t off, void *buf, size_t size) {
+  const void *p = readAt(e, off, buf, size);
+#ifdef LOADER_BLOCK_CACHE_BLOCKS
+  if (p && p != buf && e->cacheData && (const char *) p >= e->cacheData
+      && (const char *) p < e->cacheData
+          + LOADER_BLOCK_CACHE_BLOCKS * LOADER_BLOCK_CACHE_SIZE) {
+    LOADER_MEMCPY(buf, p, size);
+    p = buf;
+  }
+#endif
+  return p;
+}
+
+static const char *readString(ELFExec_t *e, off_t off, char *buf, size_t max) {
+  size_t n;
+  if (e->image) {
+    if (off < 0 || (size_t) off >= e->imageSize)
+      return NULL;
+    return e->image + off;
+  }
+#ifdef LOADER_METADATA_CACHE
+  {
+    const char *p = metaAt(e, off, 1);
+    if (p)
+      return p;
+  }
+#endif
+#ifdef LOADER_BLOCK_CACHE_BLOCKS
+  if (e->cacheData)
+    return cacheString(e, off, buf, max);
+#endif
+  /* Names of a stream are only in the buffered string tables */
+  if (IS_STREAM(e))
+    return NULL;
+  if (LOADER_SEEK_FROM_START(e->user_data, off) != 0)
+    return NULL;
+  n = LOADER_READ(e->user_data, buf, max - 1);
+  if (n == 0 || n > max - 1)
+    return NULL;
+  buf[n] = 0;
+  return buf;
+}
+
+static const char *readSectionName(ELFExec_t *e, off_t off, char *buf,
+    size_t max) {
+  return readString(e, e->sectionTableStrings + off, buf, max);
+}
+
+/*
+ * Pointer to the bytes at off and how many of them can be used (*avail).
+ * Symbol names are streamed through this in pieces, so they have no length
+ * limit and compares stop reading at the first mismatch
+ */
+static const char *readChunk(ELFExec_t *e, off_t off, char *buf,
+    size_t *avail) {
+  if (e->image) {
+    if (off < 0 || (size_t) off >= e->imageSize)
+      return NULL;
+    *avail = e->imageSize - off;
+    return e->image + off;
+  }
+#ifdef LOADER_METADATA_CACHE
+  {
+    const char *p = metaSpan(e, off, avail);
+    if (p)
+      return p;
+  }
+#endif
+#ifdef LOADER_BLOCK_CACHE_BLOCKS
+  if (e->cacheData)
+    return cacheBlockAt(e, off, avail);
+#endif
+  if (IS_STREAM(e))
+    return NULL;
+  if (LOADER_SEEK_FROM_START(e->user_data, off) != 0)
+    return NULL;
+  *avail = LOADER_READ(e->user_data, buf, LOADER_NAME_CHUNK);
+  if (*avail == 0 || *avail > LOADER_NAME_CHUNK)
+    return NULL;
+  return buf;
+}
+
+/*
+ * Compare len bytes of symbol string at off with s. Returns 1 if equal
+ */
+static int nameCompare(ELFExec_t *e, off_t off, const char *s, size_t len) {
+  char buf[LOADER_NAME_CHUNK];
+  while (len) {
+    size_t avail, i;
+    const char *p = readChunk(e, off, buf, &avail);
+    if (!p)
+      return 0;
+    if (avail > len)
+      avail = len;
+    for (i = 0; i < avail; i++)
+      if (p[i] != s[i])
+        return 0;
+    off += avail;
+    s += avail;
+    len -= avail;
+  }
+  return 1;
+}
+
+/*
+ * Compare zero terminated string at off with s. Returns 1 if equal
+ */
+static int stringEq(ELFExec_t *e, off_t off, const char *s) {
+  char buf[LOADER_NAME_CHUNK];
+  for (;;) {
+    size_t avail, i;
+    const char *p = readChunk(e, off, buf, &avail);
+    if (!p)
+      return 0;
+    for (i = 0; i < avail; i++, s++) {
+      if (p[i] != *s)
+        return 0;
+      if (!*s)
+        return 1;
+    }
+    off += avail;
+  }
 }
 
-static void freeSection(ELFSection_t *s) {
-  if (s->data)
-    LOADER_FREE(s->data);
+static int nameEq(ELFExec_t *e, Elf32_Word name, const char *s) {
+  return stringEq(e, e->symbolTableStrings + name, s);
 }
 
 static uint32_t swabo(uint32_t hl) {
@@ -152,82 +832,172 @@ static void dumpData(uint8_t *data, size_t size) {
 #endif
 }
 
-typedef enum {
-  sram = 0,
-  sdram = 1
-} MemType_t;
+static void *allocSram(size_t size, size_t align, ELFSecPerm_t perm) {
+  return LOADER_ALIGN_ALLOC(size, align, perm);
+}
 
-static int loadSecData(ELFExec_t *e, ELFSection_t *s, Elf32_Shdr *h, MemType_t memType) {
-  if (!h->sh_size) {
-    MSG(" No data for section");
-    return 0;
+static void *allocSdram(size_t size, size_t align, ELFSecPerm_t perm) {
+  return LOADER_ALIGN_ALLOC_SDRAM(size, align, perm);
+}
+
+static const ELFRegion_t defaultRegions[] = {
+  { "sram", allocSram, NULL, -1 },
+  { "sdram", allocSdram, NULL, -1 }
+};
+
+static const ELFPlacementRule_t defaultRules[] = {
+  { ".sdram", 0, 0, 1 }
+};
+
+/* Used if the host gives no placement map */
+static const ELFPlacement_t defaultPlacement = {
+  defaultRegions, sizeof(defaultRegions) / sizeof(*defaultRegions),
+  defaultRules, sizeof(defaultRules) / sizeof(*defaultRules)
+};
+
+static int hasPrefix(const char *s, const char *prefix) {
+  while (*prefix)
+    if (*s++ != *prefix++)
+      return 0;
+  return 1;
+}
+
+static int placeSection(ELFExec_t *e, const char *name, const Elf32_Shdr *h) {
+  const ELFPlacement_t *p = e->placement;
+  unsigned int i;
+  for (i = 0; i < p->rules_size; i++) {
+    const ELFPlacementRule_t *r = &p->rules[i];
+    if ((!r->prefix || hasPrefix(name, r->prefix))
+        && (h->sh_flags & r->flags) == r->flags && h->sh_size >= r->min_size
+        && r->region >= 0 && r->region < p->regions_size)
+      return r->region;
   }
-  if (memType == sdram) {
-    s->data = LOADER_ALIGN_ALLOC_SDRAM(h->sh_size, h->sh_addralign, h->sh_flags);
-  } else {
-    s->data = LOADER_ALIGN_ALLOC(h->sh_size, h->sh_addralign, h->sh_flags);
+  return 0;
+}
+
+static void freeRegion(ELFExec_t *e, int r) {
+  if (e->region[r]) {
+    if (e->placement->regions[r].free)
+      e->placement->regions[r].free(e->region[r]);
+    else
+      LOADER_FREE(e->region[r]);
   }
-  if (!s->data) {
-    ERR("    GET MEMORY fail");
-    return -1;
+  e->region[r] = NULL;
+}
+
+/*
+ * Place the sections of one region at offsets of a single block, largest
+ * alignment first so padding is only needed between alignment classes.
+ * With base NULL only computes the block size
+ */
+static size_t layoutRegion(ELFExec_t *e, int r, char *base, int maxAlign) {
+  size_t size = 0;
+  int align, n;
+  for (align = maxAlign; align >= 0; align--)
+    for (n = 1; n < e->sections; n++) {
+      ELFSection_t *s = &e->section[n];
+      if (!s->size || s->xip || s->region != r || s->align != align)
+        continue;
+      size = (size + (1u << align) - 1) & ~((1u << align) - 1);
+      if (base) {
+        s->data = base + size;
+        s->addr = (Elf32_Addr) s->data;
+      }
+      size += s->size;
+    }
+  return size;
+}
+
+/*
+ * One allocation per region for all the sections it holds, so a module
+ * costs one allocator call and one free per region. If a region can't be
+ * allocated its sections move to the fallback region, which is laid out
+ * again with them
+ */
+static int allocRegions(ELFExec_t *e) {
+  const ELFPlacement_t *p = e->placement;
+  int r, n, moves = 0;
+  for (r = 0; r < p->regions_size; r++) {
+    const ELFRegion_t *reg = &p->regions[r];
+    ELFSecPerm_t perm = 0;
+    int maxAlign = -1, fb;
+    size_t size;
+    if (e->region[r])
+      continue;
+    for (n = 1; n < e->sections; n++)
+      if (e->section[n].size && !e->section[n].xip
+          && e->section[n].region == r) {
+        if (e->section[n].align > maxAlign)
+          maxAlign = e->section[n].align;
+        perm |= e->section[n].perm;
+      }
+    if (maxAlign < 0)
+      continue;
+    size = layoutRegion(e, r, NULL, maxAlign);
+    e->region[r] = reg->alloc(size, 1u << maxAlign, perm);
+    if (e->region[r]) {
+      DBG("Region %s: %d bytes\n", reg->name, size);
+      layoutRegion(e, r, e->region[r], maxAlign);
+      continue;
+    }
+    fb = reg->fallback;
+    if (fb < 0 || fb >= p->regions_size || ++moves > p->regions_size) {
+      ERR("    GET MEMORY fail");
+      return -1;
+    }
+    DBG("Region %s: no memory for %d bytes, using %s\n", reg->name, size,
+        p->regions[fb].name);
+    for (n = 1; n < e->sections; n++)
+      if (e->section[n].region == r)
+        e->section[n].region = fb;
+    freeRegion(e, fb);
+    r = -1; /* Fallback may be an already allocated region */
   }
+  return 0;
+}
+
+/*
+ * Load size bytes of section data from pos
+ */
+static int loadSecRange(ELFExec_t *e, ELFSection_t *s, const Elf32_Shdr *h,
+    size_t pos, size_t size) {
+  char *dst = (char *) s->data + pos;
   if (h->sh_type == SHT_NOBITS) {
     // init with zeros
-    char *p = s->data;
-    int i, sz = h->sh_size;
-    for (i = 0; i < sz; i++) {
-      *p++ = 0;
-    }
+    LOADER_CLEAR(dst, size);
   } else {
-    if (LOADER_SEEK_FROM_START(e->user_data, h->sh_offset) != 0) {
-      ERR("    seek fail");
-      freeSection(s);
-      return -1;
-    }
-    if (LOADER_READ(e->user_data, s->data, h->sh_size) != h->sh_size) {
+    const void *src = readAt(e, h->sh_offset + pos, dst, size);
+    if (!src) {
       ERR("     read data fail");
       return -1;
     }
-    /* DBG("DATA: "); */
-    dumpData(s->data, h->sh_size);
+    if (src != dst)
+      LOADER_MEMCPY(dst, src, size);
   }
   return 0;
 }
 
-static int readSecHeader(ELFExec_t *e, int n, Elf32_Shdr *h) {
-  off_t offset = SECTION_OFFSET(e, n);
-  if (LOADER_SEEK_FROM_START(e->user_data, offset) != 0)
-    return -1;
-  if (LOADER_READ(e->user_data, h, sizeof(Elf32_Shdr)) != sizeof(Elf32_Shdr))
+static int loadSecData(ELFExec_t *e, ELFSection_t *s, const Elf32_Shdr *h) {
+  if (!s->data) {
+    MSG(" No data for section");
+    return 0;
+  }
+  if (loadSecRange(e, s, h, 0, h->sh_size) != 0)
     return -1;
+  if (h->sh_type != SHT_NOBITS) {
+    /* DBG("DATA: "); */
+    dumpData(s->data, h->sh_size);
+  }
   return 0;
 }
 
-static int readSection(ELFExec_t *e, int n, Elf32_Shdr *h, char *name,
-    size_t nlen) {
-  if (readSecHeader(e, n, h) != 0)
-    return -1;
-  if (h->sh_name)
-    return readSectionName(e, h->sh_name, name, nlen);
-  return 0;
+static const Elf32_Shdr *readSecHeader(ELFExec_t *e, int n, Elf32_Shdr *h) {
+  return readPinned(e, SECTION_OFFSET(e, n), h, sizeof(Elf32_Shdr));
 }
 
-static int readSymbol(ELFExec_t *e, int n, Elf32_Sym *sym, char *name,
-    size_t nlen) {
-  int ret = -1;
-  off_t old = LOADER_TELL(e->user_data);
+static const Elf32_Sym *readSymbol(ELFExec_t *e, int n, Elf32_Sym *buf) {
   off_t pos = e->symbolTable + n * sizeof(Elf32_Sym);
-  if (LOADER_SEEK_FROM_START(e->user_data, pos) == 0)
-    if (LOADER_READ(e->user_data, sym, sizeof(Elf32_Sym)) == sizeof(Elf32_Sym)) {
-      if (sym->st_name)
-        ret = readSymbolName(e, sym->st_name, name, nlen);
-      else {
-        Elf32_Shdr shdr;
-        ret = readSection(e, sym->st_shndx, &shdr, name, nlen);
-      }
-    }
-  (void) LOADER_SEEK_FROM_START(e->user_data, old);
-  return ret;
+  return readPinned(e, pos, buf, sizeof(Elf32_Sym));
 }
 
 static const char *typeStr(int symt) {
@@ -235,465 +1005,3058 @@ static const char *typeStr(int symt) {
   switch (symt) {
   STRCASE(R_ARM_NONE)
   STRCASE(R_ARM_ABS32)
+  STRCASE(R_ARM_REL32)
+  STRCASE(R_ARM_ABS16)
+  STRCASE(R_ARM_ABS8)
   STRCASE(R_ARM_THM_CALL)
+  STRCASE(R_ARM_THM_PC8)
+  STRCASE(R_ARM_GLOB_DAT)
+  STRCASE(R_ARM_JUMP_SLOT)
+  STRCASE(R_ARM_RELATIVE)
   STRCASE(R_ARM_THM_JUMP24)
   STRCASE(R_ARM_TARGET1)
+  STRCASE(R_ARM_V4BX)
+  STRCASE(R_ARM_PREL31)
+  STRCASE(R_ARM_THM_MOVW_ABS_NC)
+  STRCASE(R_ARM_THM_MOVT_ABS)
+  STRCASE(R_ARM_THM_MOVW_PREL_NC)
+  STRCASE(R_ARM_THM_MOVT_PREL)
+  STRCASE(R_ARM_THM_JUMP19)
+  STRCASE(R_ARM_THM_PC12)
+  STRCASE(R_ARM_THM_JUMP11)
+  STRCASE(R_ARM_THM_JUMP8)
   default:
     return "R_<unknow>";
   }
 #undef STRCASE
 }
 
-static void relJmpCall(Elf32_Addr relAddr, int type, Elf32_Addr symAddr) {
-  uint16_t upper_insn = ((uint16_t *) relAddr)[0];
-  uint16_t lower_insn = ((uint16_t *) relAddr)[1];
-  uint32_t S = (upper_insn >> 10) & 1;
-  uint32_t J1 = (lower_insn >> 13) & 1;
-  uint32_t J2 = (lower_insn >> 11) & 1;
-
-  int32_t offset = (S << 24) | /* S     -> offset[24] */
-  ((~(J1 ^ S) & 1) << 23) | /* J1    -> offset[23] */
-  ((~(J2 ^ S) & 1) << 22) | /* J2    -> offset[22] */
-  ((upper_insn & 0x03ff) << 12) | /* imm10 -> offset[12:21] */
-  ((lower_insn & 0x07ff) << 1); /* imm11 -> offset[1:11] */
-  if (offset & 0x01000000)
-    offset -= 0x02000000;
+/*
+ * Relocation types, by the field they patch and how the result is computed
+ * from S (symbol address, Thumb bit included), A (addend) and P (place)
+ */
+static const ELFRelHowto_t relHowto[R_ARM_THM_JUMP8 + 1] = {
+  [R_ARM_NONE] = { FieldNone, 0 },
+  [R_ARM_ABS32] = { FieldWord, 0 },
+  [R_ARM_REL32] = { FieldWord, REL_PC },
+  [R_ARM_ABS16] = { FieldHalf, REL_CHECK },
+  [R_ARM_ABS8] = { FieldByte, REL_CHECK },
+  [R_ARM_THM_CALL] = { FieldThmCall, REL_PC | REL_CHECK },
+  [R_ARM_THM_PC8] = { FieldThmPc8, REL_PC_ALIGN | REL_CHECK },
+  [R_ARM_GLOB_DAT] = { FieldGot, 0 },
+  [R_ARM_JUMP_SLOT] = { FieldGot, 0 },
+  [R_ARM_THM_JUMP24] = { FieldThmCall, REL_PC | REL_CHECK },
+  /*
+   * quoting https://sourceware.org/binutils/docs/ld/ARM.html :
+   * "interpreted as either 'R_ARM_REL32' or 'R_ARM_ABS32', depending on the
+   * target". Implementation here is as R_ARM_ABS32
+   */
+  [R_ARM_TARGET1] = { FieldWord, 0 },
+  /* Marks BX for ARMv4, nothing to do on ARMv7-M */
+  [R_ARM_V4BX] = { FieldNone, 0 },
+  [R_ARM_PREL31] = { FieldPrel31, REL_PC | REL_CHECK },
+  [R_ARM_THM_MOVW_ABS_NC] = { FieldThmMovw, 0 },
+  [R_ARM_THM_MOVT_ABS] = { FieldThmMovt, 0 },
+  [R_ARM_THM_MOVW_PREL_NC] = { FieldThmMovw, REL_PC },
+  [R_ARM_THM_MOVT_PREL] = { FieldThmMovt, REL_PC },
+  [R_ARM_THM_JUMP19] = { FieldThmJump19, REL_PC | REL_CHECK },
+  [R_ARM_THM_PC12] = { FieldThmPc12, REL_PC_ALIGN | REL_CHECK },
+  [R_ARM_THM_JUMP11] = { FieldThmJump11, REL_PC | REL_CHECK },
+  [R_ARM_THM_JUMP8] = { FieldThmJump8, REL_PC | REL_CHECK }
+};
 
-  offset += symAddr - relAddr;
+static int32_t signExtend(uint32_t v, int bits) {
+  uint32_t m = 1u << (bits - 1);
+  return (int32_t) (((v & ((m << 1) - 1)) ^ m) - m);
+}
 
-  S = (offset >> 24) & 1;
-  J1 = S ^ (~(offset >> 23) & 1);
-  J2 = S ^ (~(offset >> 22) & 1);
+static int fitsSigned(int32_t v, int bits) {
+  return (((uint32_t) v + (1u << (bits - 1))) >> bits) == 0;
+}
 
-  upper_insn = ((upper_insn & 0xf800) | (S << 10) | ((offset >> 12) & 0x03ff));
-  ((uint16_t*) relAddr)[0] = upper_insn;
+/*
+ * Addend of a REL entry, stored in the field it relocates
+ */
+/*
+ * Bytes of the field patched by relocation type, 4 for unknown types
+ */
+static size_t fieldSize(Elf32_Word type) {
+  if (type > R_ARM_THM_JUMP8)
+    return 4;
+  switch (relHowto[type].field) {
+  case FieldNone:
+    return 0;
+  case FieldByte:
+    return 1;
+  case FieldHalf:
+  case FieldThmJump11:
+  case FieldThmJump8:
+  case FieldThmPc8:
+    return 2;
+  default:
+    return 4;
+  }
+}
 
-  lower_insn = ((lower_insn & 0xd000) | (J1 << 13) | (J2 << 11)
-      | ((offset >> 1) & 0x07ff));
-  ((uint16_t*) relAddr)[1] = lower_insn;
+static int32_t fieldAddend(ELFRelField_t field, Elf32_Addr relAddr) {
+  const uint16_t *h = (const uint16_t *) relAddr;
+  switch (field) {
+  case FieldWord:
+    return *((int32_t *) relAddr);
+  case FieldPrel31:
+    return signExtend(*((uint32_t *) relAddr), 31);
+  case FieldHalf:
+    return *((int16_t *) relAddr);
+  case FieldByte:
+    return *((int8_t *) relAddr);
+  case FieldThmCall: {
+    uint32_t s = (h[0] >> 10) & 1;
+    uint32_t i1 = ~((h[1] >> 13) ^ s) & 1; /* I1 = NOT(J1 XOR S) */
+    uint32_t i2 = ~((h[1] >> 11) ^ s) & 1;
+    return signExtend((s << 24) | (i1 << 23) | (i2 << 22)
+        | ((h[0] & 0x3ff) << 12) | ((h[1] & 0x7ff) << 1), 25);
+  }
+  case FieldThmJump19:
+    return signExtend((((h[0] >> 10) & 1) << 20) | (((h[1] >> 11) & 1) << 19)
+        | (((h[1] >> 13) & 1) << 18) | ((h[0] & 0x3f) << 12)
+        | ((h[1] & 0x7ff) << 1), 21);
+  case FieldThmJump11:
+    return signExtend((h[0] & 0x7ff) << 1, 12);
+  case FieldThmJump8:
+    return signExtend((h[0] & 0xff) << 1, 9);
+  case FieldThmMovw:
+  case FieldThmMovt:
+    return (int16_t) (((h[0] & 0xf) << 12) | ((h[0] & 0x400) << 1)
+        | ((h[1] & 0x7000) >> 4) | (h[1] & 0xff));
+  case FieldThmPc8:
+    /* As binutils: -4, the PC bias, is stored as 0xff */
+    return ((((h[0] & 0xff) << 2) + 4) & 0x3ff) - 4;
+  case FieldThmPc12:
+    return (h[0] & 0x80) ? (h[1] & 0xfff) : -(h[1] & 0xfff);
+  default:
+    return 0;
+  }
 }
 
-static int relocateSymbol(Elf32_Addr relAddr, int type, Elf32_Addr symAddr) {
-  switch (type) {
-  case R_ARM_ABS32:
-    *((uint32_t*) relAddr) += symAddr;
-    DBG("  R_ARM_ABS32 relocated is 0x%08X\n", *((uint32_t* )relAddr));
+/*
+ * Write the relocation result to its field. Fails if checked and out of
+ * range, leaving the field untouched
+ */
+static int fieldWrite(ELFRelField_t field, Elf32_Addr relAddr, int32_t v,
+    int check) {
+  uint16_t *h = (uint16_t *) relAddr;
+  uint32_t u = v;
+  switch (field) {
+  case FieldWord:
+  case FieldGot:
+    *((uint32_t *) relAddr) = u;
+    break;
+  case FieldPrel31:
+    if (check && !fitsSigned(v, 31))
+      return -1;
+    *((uint32_t *) relAddr) = (*((uint32_t *) relAddr) & 0x80000000)
+        | (u & 0x7fffffff);
+    break;
+  case FieldHalf:
+    if (check && (v < -0x8000 || v > 0xffff))
+      return -1;
+    *((uint16_t *) relAddr) = u;
+    break;
+  case FieldByte:
+    if (check && (v < -0x80 || v > 0xff))
+      return -1;
+    *((uint8_t *) relAddr) = u;
+    break;
+  case FieldThmCall: {
+    uint32_t s = (u >> 24) & 1;
+    if (check && !fitsSigned(v, 25))
+      return -1;
+    h[0] = (h[0] & 0xf800) | (s << 10) | ((u >> 12) & 0x3ff);
+    h[1] = (h[1] & 0xd000) | ((s ^ (~(u >> 23) & 1)) << 13)
+        | ((s ^ (~(u >> 22) & 1)) << 11) | ((u >> 1) & 0x7ff);
+    break;
+  }
+  case FieldThmJump19:
+    if (check && !fitsSigned(v, 21))
+      return -1;
+    h[0] = (h[0] & 0xfbc0) | (((u >> 20) & 1) << 10) | ((u >> 12) & 0x3f);
+    h[1] = (h[1] & 0xd000) | (((u >> 18) & 1) << 13) | (((u >> 19) & 1) << 11)
+        | ((u >> 1) & 0x7ff);
+    break;
+  case FieldThmJump11:
+    if (check && !fitsSigned(v, 12))
+      return -1;
+    h[0] = (h[0] & 0xf800) | ((u >> 1) & 0x7ff);
+    break;
+  case FieldThmJump8:
+    if (check && !fitsSigned(v, 9))
+      return -1;
+    h[0] = (h[0] & 0xff00) | ((u >> 1) & 0xff);
     break;
-  case R_ARM_THM_CALL:
-  case R_ARM_THM_JUMP24:
-    relJmpCall(relAddr, type, symAddr);
-    DBG("  R_ARM_THM_CALL/JMP relocated is 0x%08X\n", *((uint32_t* )relAddr));
+  case FieldThmMovt:
+    u >>= 16;
+    /* fall through */
+  case FieldThmMovw:
+    h[0] = (h[0] & 0xfbf0) | ((u >> 12) & 0xf) | (((u >> 11) & 1) << 10);
+    h[1] = (h[1] & 0x8f00) | (((u >> 8) & 7) << 12) | (u & 0xff);
     break;
-  case R_ARM_TARGET1:
-    // quoting https://sourceware.org/binutils/docs/ld/ARM.html :
-    // "interpreted as either ‘R_ARM_REL32’ or ‘R_ARM_ABS32’, depending on the target"
-    // implementation here is as R_ARM_ABS32
-    *((uint32_t*) relAddr) += symAddr;
-    DBG("  R_ARM_TARGET1 relocated is 0x%08X\n", *((uint32_t* )relAddr));
+  case FieldThmPc8:
+    if (check && (u > 1020 || (u & 3)))
+      return -1;
+    h[0] = (h[0] & 0xff00) | (u >> 2);
     break;
-  case R_ARM_THM_JUMP11:
-    MSG("  R_ARM_THM_JUMP11 DISCARDED!\n");
-    // TODO : implement relocation type R_ARM_THM_JUMP11
+  case FieldThmPc12:
+    if (check && (v < -4095 || v > 4095))
+      return -1;
+    h[0] = (h[0] & ~0x80) | (v >= 0 ? 0x80 : 0);
+    h[1] = (h[1] & 0xf000) | (v >= 0 ? u : -u);
     break;
   default:
+    break;
+  }
+  return 0;
+}
+
+/*
+ * relAddr is where the relocated field is written, place its run time
+ * address (they only differ when installing to flash). addend is NULL for
+ * REL entries, whose addend is in the field
+ */
+static int relocateSymbol(Elf32_Addr relAddr, Elf32_Addr place, int type,
+    Elf32_Addr symAddr, const Elf32_Sword *addend) {
+  const ELFRelHowto_t *how;
+  int32_t v;
+  if (type < 0 || type > R_ARM_THM_JUMP8
+      || relHowto[type].field == FieldUnsupported) {
     DBG("  Undefined relocation %d\n", type);
     return -1;
   }
+  how = &relHowto[type];
+  if (how->field == FieldNone)
+    return 0;
+  v = symAddr + (addend ? *addend : fieldAddend(how->field, relAddr));
+  if (how->flags & REL_PC)
+    v -= place;
+  else if (how->flags & REL_PC_ALIGN)
+    v -= place & ~3;
+  if (fieldWrite(how->field, relAddr, v, how->flags & REL_CHECK) != 0) {
+    DBG("  %s out of range: %08X\n", typeStr(type), v);
+    return -1;
+  }
+  DBG("  %s relocated is 0x%08X\n", typeStr(type), *((uint32_t* )relAddr));
   return 0;
 }
 
-static ELFSection_t *sectionOf(ELFExec_t *e, int index) {
-#define IFSECTION(sec, i) \
-  do { \
-    if ((sec).secIdx == i) \
-      return &(sec); \
-  } while(0)
-  IFSECTION(e->text, index);
-  IFSECTION(e->rodata, index);
-  IFSECTION(e->data, index);
-  IFSECTION(e->bss, index);
-  IFSECTION(e->sdram_rodata, index);
-  IFSECTION(e->sdram_data, index);
-  IFSECTION(e->sdram_bss, index);
-  IFSECTION(e->init_array, index);
-  IFSECTION(e->fini_array, index);
-#undef IFSECTION
-  return NULL;
+/*
+ * Code generated at load time (veneers, lazy stubs) goes to the region of
+ * the code that branches to it. Installed code has no run time allocator
+ */
+static void *allocIsland(ELFExec_t *e, int region, size_t size) {
+  const ELFRegion_t *reg = &e->placement->regions[region];
+  void *p;
+  if (!reg->alloc)
+    return NULL;
+  p = reg->alloc(size, 4, ELF_SEC_READ | ELF_SEC_WRITE | ELF_SEC_EXEC);
+  if (p)
+    DBG("Island of %d bytes in %s @ %08x\n", size, reg->name,
+        (unsigned int) p);
+  return p;
 }
 
-static Elf32_Addr addressOf(ELFExec_t *e, Elf32_Sym *sym, const char *sName) {
-  if (sym->st_shndx == SHN_UNDEF) {
-    return LOADER_GETUNDEFSYMADDR(&e->user_data, sName);
+static void releaseIsland(ELFExec_t *e, int region, void *p) {
+  if (e->placement->regions[region].free)
+    e->placement->regions[region].free(p);
+  else
+    LOADER_FREE(p);
+}
+
+/*
+ * Veneer jumping to target, placed in region. Islands are only allocated
+ * when a far branch shows up, and branches to the same target from the
+ * same region share one veneer. Returns 0 if there is no memory for it
+ */
+static Elf32_Addr veneerFor(ELFExec_t *e, int region, Elf32_Addr target) {
+  ELFVeneerIsland_t *v, *room = NULL;
+  int i;
+  for (v = e->veneers; v; v = v->next) {
+    if (v->region != region)
+      continue;
+    for (i = 0; i < v->count; i++)
+      if (v->code[2 * i + 1] == target)
+        return (Elf32_Addr) &v->code[2 * i];
+    if (v->count < LOADER_VENEER_BLOCK)
+      room = v;
+  }
+  if (!room) {
+    room = allocIsland(e, region, sizeof(ELFVeneerIsland_t));
+    if (!room)
+      return 0;
+    room->next = e->veneers;
+    room->region = region;
+    room->count = 0;
+    e->veneers = room;
+  }
+  i = room->count++;
+  room->code[2 * i] = VENEER_LDR_PC;
+  room->code[2 * i + 1] = target;
+  return (Elf32_Addr) &room->code[2 * i];
+}
+
+static void freeIslands(ELFExec_t *e) {
+  while (e->veneers) {
+    ELFVeneerIsland_t *v = e->veneers;
+    e->veneers = v->next;
+    releaseIsland(e, v->region, v);
+  }
+#ifdef LOADER_LAZY_ENTRY
+  while (e->lazy) {
+    ELFLazyBlock_t *b = e->lazy;
+    e->lazy = b->next;
+    releaseIsland(e, b->region, b);
+  }
+#endif
+}
+
+/*
+ * relocateSymbol for code of section s. A BL or B.W that can't reach its
+ * target (module in external RAM calling the host in flash) goes through
+ * a veneer instead, so modules don't need -mlong-calls
+ */
+static int relocateCode(ELFExec_t *e, ELFSection_t *s, Elf32_Addr relAddr,
+    Elf32_Addr place, int type, Elf32_Addr symAddr,
+    const Elf32_Sword *addend) {
+  Elf32_Sword a;
+  Elf32_Addr veneer;
+  if (relocateSymbol(relAddr, place, type, symAddr, addend) == 0)
+    return 0;
+  if (type != R_ARM_THM_CALL && type != R_ARM_THM_JUMP24)
+    return -1;
+  /* The branch lands at S + A - P + (P + 4), aim that at the veneer */
+  a = addend ? *addend : fieldAddend(FieldThmCall, relAddr);
+  veneer = veneerFor(e, s->region, symAddr + a + 4);
+  if (!veneer) {
+    ERR("No memory for far branch veneer");
+    return -1;
+  }
+  DBG("  far branch to %08X through veneer @ %08X\n", symAddr + a + 4,
+      veneer);
+  return relocateSymbol(relAddr, place, type, veneer - a - 4, addend);
+}
+
+static ELFSection_t *sectionOf(ELFExec_t *e, int index) {
+  if (e->section && index > 0 && index < e->sections
+      && e->section[index].data)
+    return &e->section[index];
+  return NULL;
+}
+
+/*
+ * Run time address of size bytes at a module address of a linked module,
+ * 0xffffffff if they aren't in one segment. The end of a segment is valid
+ */
+static Elf32_Addr moduleAddress(ELFExec_t *e, Elf32_Addr vaddr,
+    Elf32_Word size) {
+  size_t n;
+  for (n = 0; n < e->loadMapSize; n++) {
+    const ELFLoadSegment_t *seg = &e->loadMap[n];
+    if (vaddr >= seg->vaddr && size <= seg->memsz
+        && vaddr - seg->vaddr <= seg->memsz - size)
+      return seg->addr + (vaddr - seg->vaddr);
+  }
+  return 0xffffffff;
+}
+
+/*
+ * Run time address of a defined symbol, 0xffffffff if not loaded. Symbols
+ * of linked modules hold module addresses, whatever their section
+ */
+static Elf32_Addr definedAddress(ELFExec_t *e, const Elf32_Sym *sym) {
+  ELFSection_t *symSec;
+  if (e->segments)
+    return sym->st_shndx != SHN_UNDEF && sym->st_shndx < SHN_LORESERVE
+        ? moduleAddress(e, sym->st_value, 0) : 0xffffffff;
+  symSec = sectionOf(e, sym->st_shndx);
+  return symSec ? symSec->addr + sym->st_value : 0xffffffff;
+}
+
+static Elf32_Addr addressOf(ELFExec_t *e, const Elf32_Sym *sym) {
+  if (sym->st_shndx == SHN_UNDEF) {
+    ELFName_t name;
+    if (e->segments && !sym->st_name)
+      return 0; /* Null symbol, of R_ARM_RELATIVE */
+    name.exec = e;
+    name.offset = e->symbolTableStrings + sym->st_name;
+    return LOADER_GETUNDEFSYMADDR(&e->user_data, &name);
+  } else {
+    Elf32_Addr addr = definedAddress(e, sym);
+    if (addr != 0xffffffff)
+      return addr;
+  }
+  DBG("  Can't find address for section %d\n", sym->st_shndx);
+  return 0xffffffff;
+}
+
+/*
+ * Per-load resolution table: address of each symbol table entry, filled on
+ * first use so every symbol is read and resolved once per load
+ */
+static void initSymTable(ELFExec_t *e) {
+  size_t words = (e->symbolCount + 31) / 32;
+  size_t bitmaps = 1;
+  size_t i;
+#ifdef LOADER_LAZY_ENTRY
+  bitmaps = 2;
+#endif
+  e->symAddr = LOADER_ALIGN_ALLOC(e->symbolCount * sizeof(Elf32_Addr)
+      + bitmaps * words * sizeof(uint32_t), 4, ELF_SEC_READ | ELF_SEC_WRITE);
+  if (!e->symAddr) {
+    MSG("No memory for symbol resolution table");
+    return;
+  }
+  e->symResolved = (uint32_t *) (e->symAddr + e->symbolCount);
+  for (i = 0; i < bitmaps * words; i++)
+    e->symResolved[i] = 0;
+#ifdef LOADER_LAZY_ENTRY
+  e->symLazy = e->symResolved + words;
+#endif
+}
+
+static void freeSymTable(ELFExec_t *e) {
+  if (e->symAddr)
+    LOADER_FREE(e->symAddr);
+  e->symAddr = NULL;
+  e->symResolved = NULL;
+#ifdef LOADER_LAZY_ENTRY
+  e->symLazy = NULL;
+#endif
+}
+
+#ifdef LOADER_SYMBOL_INDEX
+/*
+ * Symbols found by get_sym() through the index: defined global or weak
+ * functions and objects
+ */
+static const Elf32_Sym *indexedSymbol(ELFExec_t *e, int n, Elf32_Sym *buf) {
+  const Elf32_Sym *sym = readSymbol(e, n, buf);
+  int type, bind;
+  if (!sym || !sym->st_name)
+    return NULL;
+  type = ELF32_ST_TYPE(sym->st_info);
+  bind = ELF32_ST_BIND(sym->st_info);
+  if ((type != STT_FUNC && type != STT_OBJECT)
+      || (bind != STB_GLOBAL && bind != STB_WEAK)
+      || definedAddress(e, sym) == 0xffffffff)
+    return NULL;
+  return sym;
+}
+
+/*
+ * Hash index of exported symbols, built once after relocation. Slots and
+ * names live in one buffer: slots first, then the names, starting with an
+ * empty one so name offset 0 marks a free slot. The index is never written
+ * after load, so lookups need no locking
+ */
+static void initSymIndex(ELFExec_t *e) {
+  size_t count = 0, namesSize = 1, size = 2, i;
+  ELFSymIndexSlot_t *slots;
+  char *names;
+  for (i = 0; i < e->symbolCount; i++) {
+    Elf32_Sym symBuf;
+    const Elf32_Sym *sym = indexedSymbol(e, i, &symBuf);
+    if (sym) {
+      ELFName_t name;
+      size_t len;
+      name.exec = e;
+      name.offset = e->symbolTableStrings + sym->st_name;
+      elf_name_hash_stream(&name, 0, &len);
+      namesSize += len + 1;
+      count++;
+    }
+  }
+  while (size < 2 * count)
+    size *= 2;
+  slots = LOADER_ALIGN_ALLOC(size * sizeof(ELFSymIndexSlot_t) + namesSize, 4,
+      ELF_SEC_READ | ELF_SEC_WRITE);
+  if (!slots) {
+    MSG("No memory for symbol index");
+    return;
+  }
+  for (i = 0; i < size; i++)
+    slots[i].name = 0;
+  names = (char *) (slots + size);
+  names[0] = 0;
+  namesSize = 1;
+  for (i = 0; i < e->symbolCount; i++) {
+    Elf32_Sym symBuf;
+    const Elf32_Sym *sym = indexedSymbol(e, i, &symBuf);
+    ELFName_t name;
+    const char *p;
+    size_t len, slot;
+    uint32_t h;
+    if (!sym)
+      continue;
+    name.exec = e;
+    name.offset = e->symbolTableStrings + sym->st_name;
+    h = elf_name_hash_stream(&name, ELF32_ST_TYPE(sym->st_info), &len);
+    p = readAt(e, name.offset, names + namesSize, len + 1);
+    if (!p) {
+      LOADER_FREE(slots);
+      MSG("Symbol index read failed");
+      return;
+    }
+    if (p != names + namesSize)
+      LOADER_MEMCPY(names + namesSize, p, len + 1);
+    for (slot = h & (size - 1); slots[slot].name; slot = (slot + 1) & (size - 1))
+      ;
+    slots[slot].hash = h;
+    slots[slot].addr = definedAddress(e, sym);
+    slots[slot].name = namesSize;
+    namesSize += len + 1;
+  }
+  DBG("Symbol index: %d symbols, %d slots\n", count, size);
+  e->symIndex = slots;
+  e->symIndexSize = size;
+  e->symIndexNames = namesSize;
+}
+
+/*
+ * Whether get_sym() can still scan the symbol table once loading ended
+ */
+static int symtabAvailable(ELFExec_t *e) {
+#ifdef LOADER_METADATA_CACHE
+  if (e->meta)
+    return 1;
+#endif
+  return !e->fileClosed && !IS_STREAM(e);
+}
+
+static void *findIndexedSymbol(ELFExec_t *e, const char *sym_name, int type) {
+  const char *names = (const char *) (e->symIndex + e->symIndexSize);
+  size_t mask = e->symIndexSize - 1;
+  uint32_t h = elf_name_hash_seed(sym_name, type);
+  size_t slot;
+  for (slot = h & mask; e->symIndex[slot].name; slot = (slot + 1) & mask) {
+    const ELFSymIndexSlot_t *s = &e->symIndex[slot];
+    if (s->hash == h && LOADER_STREQ(names + s->name, sym_name))
+      return (void *) s->addr;
+  }
+  DBG("sym \"%s\" not indexed\n", sym_name);
+  return NULL;
+}
+#endif
+
+static int symResolved(ELFExec_t *e, Elf32_Word n) {
+  return e->symAddr && n < e->symbolCount
+      && (e->symResolved[n / 32] & (1u << (n % 32)));
+}
+
+static void setSymResolved(ELFExec_t *e, Elf32_Word n, Elf32_Addr addr) {
+  if (e->symAddr && n < e->symbolCount) {
+    e->symAddr[n] = addr;
+    e->symResolved[n / 32] |= 1u << (n % 32);
+#ifdef LOADER_LAZY_ENTRY
+    e->symLazy[n / 32] &= ~(1u << (n % 32));
+#endif
+  }
+}
+
+#ifdef LOADER_LAZY_ENTRY
+/* Resolved to a lazy stub, not to the import itself */
+static int symLazy(ELFExec_t *e, Elf32_Word n) {
+  return symResolved(e, n) && (e->symLazy[n / 32] & (1u << (n % 32)));
+}
+
+/*
+ * Whether every relocation of the batch against symbol idx is a plain call
+ * or tail call of it, which a stub can stand for
+ */
+static int onlyCalls(const ELFSection_t *s, const void *rel, size_t count,
+    size_t entSize, Elf32_Word idx) {
+  size_t i;
+  for (i = 0; i < count; i++) {
+    const Elf32_Rel *r = REL_ENTRY(rel, i, entSize);
+    int type = ELF32_R_TYPE(r->r_info);
+    Elf32_Sword a;
+    if (ELF32_R_SYM(r->r_info) != idx)
+      continue;
+    if (type != R_ARM_THM_CALL && type != R_ARM_THM_JUMP24)
+      return 0;
+    if (entSize == sizeof(Elf32_Rela))
+      a = ((const Elf32_Rela *) r)->r_addend;
+    else
+      a = fieldAddend(FieldThmCall, (Elf32_Addr) s->data + r->r_offset);
+    if (a != -4) /* Lands at S, see relocateCode */
+      return 0;
+  }
+  return 1;
+}
+
+/*
+ * New lazy stub for import sym, placed in region. Returns 0 if there is
+ * no memory for it
+ */
+static Elf32_Addr lazyStub(ELFExec_t *e, int region, Elf32_Word sym) {
+  ELFLazyBlock_t *b;
+  ELFLazyStub_t *stub;
+  for (b = e->lazy; b; b = b->next)
+    if (b->region == region && b->count < LOADER_LAZY_BLOCK)
+      break;
+  if (!b) {
+    b = allocIsland(e, region, sizeof(ELFLazyBlock_t));
+    if (!b)
+      return 0;
+    b->next = e->lazy;
+    b->region = region;
+    b->count = 0;
+    e->lazy = b;
+  }
+  stub = &b->stub[b->count++];
+  stub->jump = VENEER_LDR_PC;
+  stub->target = ((Elf32_Addr) stub->bind) | 1;
+  stub->bind[0] = LAZY_BIND_0;
+  stub->bind[1] = LAZY_BIND_1;
+  stub->entry = (Elf32_Addr) LOADER_LAZY_ENTRY;
+  stub->exec = e;
+  stub->sym = sym;
+  return (Elf32_Addr) stub;
+}
+
+void *elf_lazy_bind(void *ip) {
+  ELFLazyStub_t *stub = (ELFLazyStub_t *) ((char *) ip - LAZY_STUB_IP);
+  Elf32_Sym symBuf;
+  const Elf32_Sym *sym = readSymbol(stub->exec, stub->sym, &symBuf);
+  Elf32_Addr addr = sym ? addressOf(stub->exec, sym) : 0xffffffff;
+  if (addr == 0xffffffff) {
+    DBG("Lazy import %d not resolved\n", stub->sym);
+    return NULL;
+  }
+  DBG("Lazy import %d bound to %08x\n", stub->sym, addr);
+  stub->target = addr;
+  return (void *) addr;
+}
+#endif
+
+/*
+ * Bind imports listed in .elfloader.imports (tools/mkimports.py) to host
+ * ABI ordinals: the resolution table is filled up front, so relocation
+ * never reads these symbols or their names.
+ *
+ * Section layout (words): magic, ABI hash, ABI ordinals, count, then count
+ * pairs of symbol index, ordinal
+ */
+static int loadImports(ELFExec_t *e) {
+  Elf32_Word hdrBuf[4], entBuf[2 * LOADER_REL_BATCH];
+  const Elf32_Word *hdr;
+  Elf32_Word abiHash, count, first, n, i;
+  if (!e->importsSize)
+    return 0;
+  hdr = readPinned(e, e->importsOffset, hdrBuf, sizeof(hdrBuf));
+  if (!hdr || hdr[0] != ELF_IMPORTS_MAGIC
+      || (e->importsSize - sizeof(hdrBuf)) / (2 * sizeof(Elf32_Word)) < hdr[3]) {
+    ERR("Invalid .elfloader.imports");
+    return -1;
+  }
+  if (!e->symAddr) {
+    MSG("No resolution table, imports resolved by name");
+    return 0;
+  }
+  abiHash = hdr[1];
+  count = hdr[3];
+  DBG("Binding %d imports to ABI %08X\n", count, abiHash);
+  for (first = 0; first < count; first += n) {
+    const Elf32_Word *ent;
+    n = count - first;
+    if (n > LOADER_REL_BATCH)
+      n = LOADER_REL_BATCH;
+    ent = readPinned(e, e->importsOffset + sizeof(hdrBuf)
+        + first * 2 * sizeof(Elf32_Word), entBuf, n * 2 * sizeof(Elf32_Word));
+    if (!ent)
+      return -1;
+    for (i = 0; i < n; i++) {
+      Elf32_Addr addr = LOADER_GETIMPORTADDR(&e->user_data, abiHash,
+          ent[2 * i + 1]);
+      if (addr == 0xffffffff) {
+        DBG("  No host ordinal %d for symbol %d\n", ent[2 * i + 1], ent[2 * i]);
+        return -1;
+      }
+      setSymResolved(e, ent[2 * i], addr);
+    }
+  }
+  return 0;
+}
+
+/*
+ * Insert symbol index in sorted set of batch symbols. Returns set size
+ */
+static int addBatchSymbol(Elf32_Word *set, int n, Elf32_Word idx) {
+  int lo = 0, hi = n, i;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (set[mid] < idx)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo < n && set[lo] == idx)
+    return n;
+  for (i = n; i > lo; i--)
+    set[i] = set[i - 1];
+  set[lo] = idx;
+  return n + 1;
+}
+
+static int findBatchSymbol(const Elf32_Word *set, int n, Elf32_Word idx) {
+  int lo = 0, hi = n - 1;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (set[mid] < idx)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/*
+ * Resolve the distinct symbols referenced by a batch of relocations, in
+ * ascending symbol table order. Returns their count, -1 on error
+ */
+static int resolveBatch(ELFExec_t *e, const ELFSection_t *s,
+    const void *rel, size_t count, size_t entSize, Elf32_Word *symIdx,
+    Elf32_Addr *symAddr) {
+  size_t i;
+  int nSyms = 0, j;
+  for (i = 0; i < count; i++)
+    nSyms = addBatchSymbol(symIdx, nSyms,
+        ELF32_R_SYM(REL_ENTRY(rel, i, entSize)->r_info));
+
+  for (j = 0; j < nSyms; j++) {
+    Elf32_Sym symBuf;
+    const Elf32_Sym *sym;
+
+    if (symResolved(e, symIdx[j])
+#ifdef LOADER_LAZY_ENTRY
+        && (!symLazy(e, symIdx[j])
+        || (s && onlyCalls(s, rel, count, entSize, symIdx[j])))
+#endif
+        ) {
+      symAddr[j] = e->symAddr[symIdx[j]];
+      continue;
+    }
+    sym = readSymbol(e, symIdx[j], &symBuf);
+    if (!sym) {
+      ERR("read symbol %d failed", symIdx[j]);
+      return -1;
+    }
+#ifdef LOADER_LAZY_ENTRY
+    /* Imports only called are bound on first call */
+    if (s && sym->st_shndx == SHN_UNDEF && sym->st_name && e->symAddr
+        && !symResolved(e, symIdx[j])
+#if defined(LOADER_STREAM) && !defined(LOADER_METADATA_KEEP)
+        /* Nothing to bind from once the stream is consumed */
+        && !e->stream
+#endif
+        && onlyCalls(s, rel, count, entSize, symIdx[j])) {
+      symAddr[j] = lazyStub(e, s->region, symIdx[j]);
+      if (symAddr[j]) {
+        DBG("  sym %d lazy @ %08X\n", symIdx[j], symAddr[j]);
+        setSymResolved(e, symIdx[j], symAddr[j]);
+        e->symLazy[symIdx[j] / 32] |= 1u << (symIdx[j] % 32);
+        continue;
+      }
+    }
+#endif
+    symAddr[j] = addressOf(e, sym);
+    if (symAddr[j] == 0xffffffff) {
+      DBG("  No symbol address of sym %d\n", symIdx[j]);
+      return -1;
+    }
+    DBG("  sym %d = %08X\n", symIdx[j], symAddr[j]);
+#ifdef LOADER_LAZY_ENTRY
+    /* Also needed by address: its stub can be bound right away */
+    if (symLazy(e, symIdx[j]))
+      ((ELFLazyStub_t *) e->symAddr[symIdx[j]])->target = symAddr[j];
+#endif
+    setSymResolved(e, symIdx[j], symAddr[j]);
+  }
+  return nSyms;
+}
+
+/*
+ * Apply entries first to last (not included) of relocation section h.
+ * Relocations are processed in batches of LOADER_REL_BATCH entries: the
+ * entries are read at once, the distinct symbols they reference are
+ * resolved in ascending symbol table order and then the whole batch is
+ * applied. SHT_RELA entries carry their addend, SHT_REL ones find it in the
+ * relocated field
+ */
+static int relocateRange(ELFExec_t *e, const Elf32_Shdr *h, ELFSection_t *s,
+    size_t first, size_t last) {
+  Elf32_Rela relBuf[LOADER_REL_BATCH];
+  Elf32_Word symIdx[LOADER_REL_BATCH];
+  Elf32_Addr symAddr[LOADER_REL_BATCH];
+  int rela = h->sh_type == SHT_RELA;
+  size_t entSize = REL_SIZE(h);
+  size_t count, i;
+  for (; first < last; first += count) {
+    const void *batch;
+    int nSyms, j;
+    count = last - first;
+    if (count > LOADER_REL_BATCH)
+      count = LOADER_REL_BATCH;
+    batch = readPinned(e, h->sh_offset + first * entSize, relBuf,
+        count * entSize);
+    if (!batch) {
+      ERR("read relocations failed");
+      return -1;
+    }
+    nSyms = resolveBatch(e, s, batch, count, entSize, symIdx, symAddr);
+    if (nSyms < 0)
+      return -1;
+
+    for (i = 0; i < count; i++) {
+      const Elf32_Rel *rel = REL_ENTRY(batch, i, entSize);
+      int relType = ELF32_R_TYPE(rel->r_info);
+      Elf32_Addr relAddr = ((Elf32_Addr) s->data) + rel->r_offset;
+      Elf32_Addr place = s->addr + rel->r_offset;
+      j = findBatchSymbol(symIdx, nSyms, ELF32_R_SYM(rel->r_info));
+      DBG(" %08X %08X %-16s %d\n", rel->r_offset, rel->r_info,
+          typeStr(relType), symIdx[j]);
+      if (relocateCode(e, s, relAddr, place, relType, symAddr[j],
+          rela ? &((const Elf32_Rela *) rel)->r_addend : NULL) == -1) {
+        ERR("relocate failed of sym %d, type %d", symIdx[j], relType);
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+ * Apply relocation section h to its target section s
+ */
+static int relocate(ELFExec_t *e, const Elf32_Shdr *h, ELFSection_t *s) {
+  if (s->data) {
+    DBG(" Offset   Info     Type             Name\n");
+    return relocateRange(e, h, s, 0, h->sh_size / REL_SIZE(h));
+  } else {
+    MSG("Section not loaded");
+  }
+  return -1;
+}
+
+/*
+ * Execute in place: read-only sections with no relocations (or relocated
+ * at install time) are used from the mapped image instead of RAM copies
+ */
+static void mapInPlace(ELFExec_t *e) {
+  int n;
+  for (n = 1; n < e->sections; n++) {
+    ELFSection_t *s = &e->section[n];
+    Elf32_Shdr hdrBuf;
+    const Elf32_Shdr *h;
+    const char *p;
+    if (!s->size || s->relSecIdx || s->kind != SecData)
+      continue;
+    h = readSecHeader(e, n, &hdrBuf);
+    if (!h || h->sh_type == SHT_NOBITS || (h->sh_flags & SHF_WRITE))
+      continue;
+    p = readAt(e, h->sh_offset, NULL, h->sh_size);
+    if (!p || ((uintptr_t) p & ((1u << s->align) - 1)))
+      continue;
+    DBG("Section %d in place @ %08x\n", n, (unsigned int) p);
+    s->data = (void *) p;
+    s->addr = (Elf32_Addr) p;
+    s->xip = 1;
+  }
+}
+
+static int regionByName(ELFExec_t *e, const char *name) {
+  int r;
+  for (r = 0; r < e->placement->regions_size; r++)
+    if (e->placement->regions[r].name
+        && LOADER_STREQ(e->placement->regions[r].name, name))
+      return r;
+  return -1;
+}
+
+/*
+ * Apply placement manifest (.elfloader.placement, see tools/mkplacement.py)
+ * over the host rules: a list of {section, region name} made from an
+ * execution profile. Regions unknown to the host are ignored
+ */
+static void applyManifest(ELFExec_t *e) {
+  const Elf32_Word *hdr;
+  const Elf32_Half *ent;
+  const char *names;
+  char *buf;
+  Elf32_Word i, count;
+  if (!e->manifestSize)
+    return;
+  buf = LOADER_ALIGN_ALLOC(e->manifestSize, 4, ELF_SEC_READ | ELF_SEC_WRITE);
+  if (!buf) {
+    MSG("No memory for placement manifest");
+    return;
+  }
+  hdr = readAt(e, e->manifestOffset, buf, e->manifestSize);
+  if (!hdr || e->manifestSize < 3 * sizeof(Elf32_Word)
+      || hdr[0] != ELF_PLACEMENT_MAGIC
+      || (e->manifestSize - 3 * sizeof(Elf32_Word)) / 4 < hdr[1]
+      || e->manifestSize - 3 * sizeof(Elf32_Word) - hdr[1] * 4 < hdr[2]
+      || (hdr[2] && ((const char *) (hdr + 3 + hdr[1]))[hdr[2] - 1])) {
+    MSG("Invalid placement manifest");
+    LOADER_FREE(buf);
+    return;
+  }
+  count = hdr[1];
+  ent = (const Elf32_Half *) (hdr + 3);
+  names = (const char *) (hdr + 3 + count);
+  for (i = 0; i < count; i++) {
+    Elf32_Half sec = ent[2 * i], want = ent[2 * i + 1];
+    const char *name = names, *end = names + hdr[2];
+    int r;
+    while (want-- && name < end)
+      while (*name++)
+        ;
+    if (name >= end || sec == 0 || sec >= e->sections
+        || !e->section[sec].size)
+      continue;
+    r = regionByName(e, name);
+    DBG("Manifest: section %d to %s%s\n", sec, name, r < 0 ? " (none)" : "");
+    if (r >= 0)
+      e->section[sec].region = r;
+  }
+  LOADER_FREE(buf);
+}
+
+/*
+ * Allocated sections are loaded by flags whatever their name, so modules
+ * built with -ffunction-sections/-fdata-sections need no merging. Names
+ * only select the region (see placeSection), the entry section (.text)
+ * and the imports
+ */
+static int placeInfo(ELFExec_t *e, const Elf32_Shdr *sh, const char *name,
+    int n) {
+  ELFSection_t *s = &e->section[n];
+  if (sh->sh_type == SHT_SYMTAB) {
+    e->symbolTable = sh->sh_offset;
+    e->symbolCount = sh->sh_size / sizeof(Elf32_Sym);
+    e->strTabIdx = sh->sh_link;
+    return FoundSymTab;
+  } else if (sh->sh_type == SHT_REL || sh->sh_type == SHT_RELA) {
+    if (sh->sh_info > 0 && sh->sh_info < e->sections)
+      e->section[sh->sh_info].relSecIdx = n;
+  } else if (sh->sh_flags & SHF_ALLOC) {
+    Elf32_Word align = sh->sh_addralign;
+    s->size = sh->sh_size;
+    s->region = placeSection(e, name, sh);
+    s->perm = sh->sh_flags & (ELF_SEC_READ | ELF_SEC_WRITE | ELF_SEC_EXEC);
+    for (s->align = 0; align > 1; align >>= 1)
+      s->align++;
+    if (sh->sh_type == SHT_INIT_ARRAY || hasPrefix(name, ".init_array"))
+      s->kind = SecInitArray;
+    else if (sh->sh_type == SHT_FINI_ARRAY || hasPrefix(name, ".fini_array"))
+      s->kind = SecFiniArray;
+    if (LOADER_STREQ(name, ".text")) {
+      e->textIdx = n;
+      return FoundText;
+    }
+  } else if (LOADER_STREQ(name, ".elfloader.imports")) {
+    e->importsOffset = sh->sh_offset;
+    e->importsSize = sh->sh_size;
+  } else if (LOADER_STREQ(name, ".elfloader.placement")) {
+    e->manifestOffset = sh->sh_offset;
+    e->manifestSize = sh->sh_size;
+  }
+  return 0;
+}
+
+static int allocSectionTable(ELFExec_t *e) {
+  int n;
+  e->section = LOADER_ALIGN_ALLOC(e->sections * sizeof(ELFSection_t)
+      + e->placement->regions_size * sizeof(void *), 4,
+      ELF_SEC_READ | ELF_SEC_WRITE);
+  if (!e->section) {
+    ERR("No memory for section table");
+    return -1;
+  }
+  e->region = (void **) (e->section + e->sections);
+  for (n = 0; n < e->placement->regions_size; n++)
+    e->region[n] = NULL;
+  for (n = 0; n < e->sections; n++) {
+    e->section[n].data = NULL;
+    e->section[n].addr = 0;
+    e->section[n].size = 0;
+    e->section[n].relSecIdx = 0;
+    e->section[n].kind = SecData;
+    e->section[n].region = 0;
+    e->section[n].align = 0;
+    e->section[n].perm = 0;
+    e->section[n].xip = 0;
+  }
+  return 0;
+}
+
+#ifdef LOADER_FLASH_WRITE
+static const ELFRegion_t installRegions[] = {
+  { "ram", NULL, NULL, -1 },
+  { "bss", NULL, NULL, -1 },
+  { "flash", NULL, NULL, -1 }
+};
+
+static const ELFPlacement_t installPlacement = {
+  installRegions, InstallRegions, NULL, 0
+};
+
+/*
+ * Install layout: writable sections go to the RAM block reserved for the
+ * module, initialized data first and .bss after it. The rest is staged in
+ * one buffer and linked at its flash address, behind the image header and
+ * section table
+ */
+static int layoutInstall(ELFExec_t *e) {
+  const ELFInstall_t *t = e->install;
+  ELFInstallHeader_t *ih = &e->installHeader;
+  int maxAlign[InstallRegions] = { 0, 0, 2 };
+  size_t size[InstallRegions];
+  char *stage;
+  int n, r;
+  for (n = 1; n < e->sections; n++) {
+    ELFSection_t *s = &e->section[n];
+    if (!s->size)
+      continue;
+    s->region = InstallFlash;
+    if (s->perm & ELF_SEC_WRITE) {
+      Elf32_Shdr hdrBuf;
+      const Elf32_Shdr *h = readSecHeader(e, n, &hdrBuf);
+      if (!h)
+        return -1;
+      s->region = h->sh_type == SHT_NOBITS ? InstallBss : InstallData;
+    }
+    if (s->align > maxAlign[s->region])
+      maxAlign[s->region] = s->align;
+  }
+  for (r = 0; r < InstallRegions; r++)
+    size[r] = layoutRegion(e, r, NULL, maxAlign[r]);
+  ih->code = sizeof(ELFInstallHeader_t)
+      + e->sections * sizeof(ELFInstallSection_t);
+  ih->code = (ih->code + (1u << maxAlign[InstallFlash]) - 1)
+      & ~((1u << maxAlign[InstallFlash]) - 1);
+  ih->codeSize = size[InstallFlash];
+  ih->ram = (Elf32_Addr) t->ram;
+  ih->dataSize = size[InstallData];
+  ih->bssStart = (size[InstallData] + (1u << maxAlign[InstallBss]) - 1)
+      & ~((1u << maxAlign[InstallBss]) - 1);
+  ih->bssSize = size[InstallBss];
+  if ((t->flash & ((1u << maxAlign[InstallFlash]) - 1))
+      || (ih->ram & ((1u << maxAlign[InstallData]) - 1))
+      || (ih->ram & ((1u << maxAlign[InstallBss]) - 1))
+      || ih->bssStart + ih->bssSize > t->ram_size
+      || ih->code + ih->codeSize > t->flash_size) {
+    ERR("Install target misaligned or too small");
+    return -1;
+  }
+  if (ih->codeSize) {
+    stage = LOADER_ALIGN_ALLOC(ih->codeSize, 1u << maxAlign[InstallFlash],
+        ELF_SEC_READ | ELF_SEC_WRITE);
+    if (!stage) {
+      ERR("No memory to stage flash sections");
+      return -1;
+    }
+    e->region[InstallFlash] = stage;
+    layoutRegion(e, InstallFlash, stage, maxAlign[InstallFlash]);
+    for (n = 1; n < e->sections; n++)
+      if (e->section[n].size && e->section[n].region == InstallFlash)
+        e->section[n].addr = t->flash + ih->code
+            + ((char *) e->section[n].data - stage);
+  }
+  layoutRegion(e, InstallData, t->ram, maxAlign[InstallData]);
+  layoutRegion(e, InstallBss, (char *) t->ram + ih->bssStart,
+      maxAlign[InstallBss]);
+  return 0;
+}
+#endif
+
+static void initPlacement(ELFExec_t *e) {
+#ifdef LOADER_PLACEMENT
+  if (!e->placement)
+    e->placement = LOADER_PLACEMENT(&e->user_data);
+#endif
+  if (!e->placement)
+    e->placement = &defaultPlacement;
+}
+
+/*
+ * Section of the entry point. ld -r stores e_entry relative to the section
+ * of the entry symbol without naming it, and with -ffunction-sections that
+ * isn't .text: it is the function defined at e_entry, with _start (ENTRY of
+ * app/elf*.ld) and then .text breaking ties between split sections
+ */
+static void findEntrySection(ELFExec_t *e) {
+  int best = 0, bestScore = 0;
+  size_t i;
+  for (i = 1; i < e->symbolCount; i++) {
+    Elf32_Sym symBuf;
+    const Elf32_Sym *sym = readSymbol(e, i, &symBuf);
+    const ELFSection_t *s;
+    int score;
+    if (!sym)
+      return;
+    if (ELF32_ST_TYPE(sym->st_info) != STT_FUNC || sym->st_value != e->entry)
+      continue;
+    s = sectionOf(e, sym->st_shndx);
+    if (!s || !(s->perm & ELF_SEC_EXEC))
+      continue;
+    if (sym->st_name && nameEq(e, sym->st_name, "_start"))
+      score = 4;
+    else if (sym->st_shndx == e->textIdx)
+      score = 3;
+    else
+      score = ELF32_ST_BIND(sym->st_info) == STB_LOCAL ? 1 : 2;
+    if (score > bestScore) {
+      best = sym->st_shndx;
+      bestScore = score;
+    }
+  }
+  if (best) {
+    DBG("Entry in section %d\n", best);
+    e->textIdx = best;
+  }
+}
+
+static int loadSymbols(ELFExec_t *e) {
+  int n;
+  int founded = 0;
+  MSG("Scan ELF indexes...");
+  initPlacement(e);
+  if (allocSectionTable(e) != 0)
+    return FoundERROR;
+  for (n = 1; n < e->sections; n++) {
+    Elf32_Shdr hdrBuf;
+    const Elf32_Shdr *sectHdr;
+    char nameBuf[LOADER_MAX_SYM_LENGTH];
+    const char *name = NULL;
+    sectHdr = readSecHeader(e, n, &hdrBuf);
+    if (!sectHdr) {
+      ERR("Error reading section");
+      return FoundERROR;
+    }
+    if (sectHdr->sh_name)
+      name = readSectionName(e, sectHdr->sh_name, nameBuf, sizeof(nameBuf));
+    if (!name)
+      name = "<unamed>";
+    DBG("Examining section %d %s\n", n, name);
+    founded |= placeInfo(e, sectHdr, name, n);
+  }
+  if (e->xip)
+    mapInPlace(e);
+  applyManifest(e);
+#ifdef LOADER_FLASH_WRITE
+  if (e->install) {
+    if (layoutInstall(e) != 0)
+      return FoundERROR;
+  } else
+#endif
+  if (allocRegions(e) != 0)
+    return FoundERROR;
+  /*
+   * Streamed sections are read along with their relocations, incremental
+   * loads read them in load_step()
+   */
+  for (n = 1; n < e->sections && !IS_STREAM(e) && !IS_STEPPED(e); n++) {
+    Elf32_Shdr hdrBuf;
+    const Elf32_Shdr *sectHdr;
+    if (!e->section[n].data || e->section[n].xip)
+      continue;
+    sectHdr = readSecHeader(e, n, &hdrBuf);
+    if (!sectHdr || loadSecData(e, &e->section[n], sectHdr) != 0)
+      return FoundERROR;
+  }
+  if (IS_FLAGS_SET(founded, FoundSymTab) && e->strTabIdx > 0
+      && e->strTabIdx < e->sections) {
+    Elf32_Shdr hdrBuf;
+    const Elf32_Shdr *str = readSecHeader(e, e->strTabIdx, &hdrBuf);
+    if (str) {
+      e->symbolTableStrings = str->sh_offset;
+      founded |= FoundStrTab;
+    }
+  }
+  if (e->entry && IS_FLAGS_SET(founded, FoundValid))
+    findEntrySection(e);
+  MSG("Done");
+  return founded;
+}
+
+#ifdef LOADER_METADATA_CACHE
+static void freeMetadata(ELFExec_t *e) {
+  int i;
+  if (e->meta)
+    LOADER_FREE(e->meta);
+  e->meta = NULL;
+  for (i = 0; i < MetaRanges; i++)
+    e->metaRange[i].data = NULL;
+}
+
+static int readMetaRange(ELFExec_t *e, ELFMetaIdx_t idx, char *dst,
+    off_t offset, size_t size) {
+  if (size && !IS_STEPPED(e) && !fileRead(e, offset, dst, size))
+    return -1;
+  e->metaRange[idx].offset = offset;
+  e->metaRange[idx].size = size;
+  e->metaRange[idx].data = dst;
+  return 0;
+}
+
+/*
+ * Tables are read in file order, so a stream never goes back. A string
+ * table shared by sections and symbols is read once
+ */
+static int readMetaRanges(ELFExec_t *e, const Elf32_Shdr **h, char **dst) {
+  int done = 1 << MetaSecHdrs;
+  while (done != (1 << MetaRanges) - 1) {
+    int i, next = -1;
+    for (i = 0; i < MetaRanges; i++)
+      if (!(done & (1 << i))
+          && (next < 0 || h[i]->sh_offset < h[next]->sh_offset))
+        next = i;
+    for (i = 0; i < MetaRanges; i++)
+      if ((done & (1 << i)) && i != MetaSecHdrs
+          && h[i]->sh_offset == h[next]->sh_offset
+          && h[i]->sh_size == h[next]->sh_size)
+        break;
+    if (i < MetaRanges)
+      e->metaRange[next] = e->metaRange[i];
+    else if (readMetaRange(e, next, dst[next], h[next]->sh_offset,
+        h[next]->sh_size) != 0)
+      return -1;
+    done |= 1 << next;
+  }
+  return 0;
+}
+
+/*
+ * Lay out the section header table hdrs, section names, symbol table and
+ * symbol names in a single allocation and read the tables into it. An
+ * incremental load only lays them out, load_step() reads them
+ */
+static int layoutMetadata(ELFExec_t *e, const Elf32_Shdr *hdrs,
+    int shstrndx) {
+  size_t hdrSize = e->sections * sizeof(Elf32_Shdr);
+  size_t shstrSize, symSize, strSize, total;
+  const Elf32_Shdr *shstr, *sym = NULL, *str;
+  const Elf32_Shdr *range[MetaRanges];
+  char *dst[MetaRanges];
+  char *p;
+  int n;
+
+  for (n = 1; n < e->sections && !sym; n++)
+    if (hdrs[n].sh_type == SHT_SYMTAB && hdrs[n].sh_link < e->sections)
+      sym = &hdrs[n];
+  if (!sym || shstrndx >= e->sections)
+    return -1;
+  shstr = &hdrs[shstrndx];
+  str = &hdrs[sym->sh_link];
+  shstrSize = (shstr->sh_size + 3) & ~3;
+  symSize = sym->sh_size;
+  strSize = str->sh_size;
+  total = hdrSize + shstrSize + symSize + strSize;
+
+  e->meta = LOADER_ALIGN_ALLOC(total, 4, ELF_SEC_READ | ELF_SEC_WRITE);
+  if (!e->meta) {
+    MSG("No memory for metadata cache");
+    return -1;
+  }
+  p = e->meta;
+  LOADER_MEMCPY(p, hdrs, hdrSize);
+  e->metaRange[MetaSecHdrs].offset = e->sectionTable;
+  e->metaRange[MetaSecHdrs].size = hdrSize;
+  e->metaRange[MetaSecHdrs].data = p;
+  p += hdrSize;
+  range[MetaSecStrings] = shstr;
+  dst[MetaSecStrings] = p;
+  range[MetaSymbols] = sym;
+  dst[MetaSymbols] = p + shstrSize;
+  range[MetaSymStrings] = str;
+  dst[MetaSymStrings] = p + shstrSize + symSize;
+  if (readMetaRanges(e, range, dst) != 0) {
+    MSG("Metadata cache read fail");
+    freeMetadata(e);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Read section header table, section names, symbol table and symbol names
+ * into a single allocation, so lookups during load are served from RAM.
+ * Failure is not fatal: the loader falls back to reading from file.
+ */
+static void loadMetadata(ELFExec_t *e, int shstrndx) {
+  size_t hdrSize = e->sections * sizeof(Elf32_Shdr);
+  Elf32_Shdr *hdrs;
+
+  if (!hdrSize)
+    return;
+  hdrs = LOADER_ALIGN_ALLOC(hdrSize, 4, ELF_SEC_READ | ELF_SEC_WRITE);
+  if (!hdrs) {
+    MSG("No memory for metadata cache");
+    return;
+  }
+  if (fileRead(e, e->sectionTable, hdrs, hdrSize))
+    layoutMetadata(e, hdrs, shstrndx);
+  LOADER_FREE(hdrs);
+}
+#endif
+
+static int initElf(ELFExec_t *e) {
+  Elf32_Ehdr hBuf;
+  Elf32_Shdr sHBuf;
+  const Elf32_Ehdr *h;
+  const Elf32_Shdr *sH;
+
+  if (!e->image && !LOADER_FD_VALID(e->user_data))
+    return -1;
+
+  h = readPinned(e, 0, &hBuf, sizeof(hBuf));
+  if (!h)
+    return -1;
+
+  const char elfmagic[EI_MAGIC_SIZE] = EI_MAGIC;
+  if (h->e_ident[EI_MAG0] != elfmagic[EI_MAG0]) return 1;
+  if (h->e_ident[EI_MAG1] != elfmagic[EI_MAG1]) return 1;
+  if (h->e_ident[EI_MAG2] != elfmagic[EI_MAG2]) return 1;
+  if (h->e_ident[EI_MAG3] != elfmagic[EI_MAG3]) return 1;
+  if (h->e_ident[EI_CLASS] != ELFCLASS32) return 1;
+  if (h->e_type != ET_REL && h->e_type != ET_EXEC && h->e_type != ET_DYN)
+    return 1;
+  if (h->e_machine != EM_ARM) return 1;
+  if (h->e_version != EV_CURRENT) return 1;
+
+  e->entry = h->e_entry;
+  if (h->e_type != ET_REL) {
+    if (IS_STREAM(e)) {
+      MSG("Only relocatable modules can be streamed");
+      return 1;
+    }
+    /* Linked modules are loaded through program headers only */
+    if (!h->e_phnum || h->e_phentsize != sizeof(Elf32_Phdr)) return 1;
+    e->segments = h->e_phnum;
+    e->segmentTable = h->e_phoff;
+    return 0;
+  }
+  /* Headers are accessed in place when loading from memory */
+  if (e->image && (h->e_shoff & 3)) return 1;
+
+  e->sections = h->e_shnum;
+  e->sectionTable = h->e_shoff;
+
+#ifdef LOADER_INCREMENTAL
+  /* Metadata is read later, by load_step() */
+  e->stepShStrIdx = h->e_shstrndx;
+#endif
+#ifdef LOADER_METADATA_CACHE
+  if (!e->image && !IS_STEPPED(e))
+    loadMetadata(e, h->e_shstrndx);
+#endif
+#ifdef LOADER_STREAM
+  if (e->stream && !e->meta) {
+    MSG("Stream without headers and symbols up front");
+    return -1;
+  }
+#endif
+
+  sH = readAt(e, SECTION_OFFSET(e, h->e_shstrndx), &sHBuf, sizeof(Elf32_Shdr));
+  if (!sH)
+    return -1;
+  e->sectionTableStrings = sH->sh_offset;
+
+  return 0;
+}
+
+static void freeElf(ELFExec_t *e) {
+  int r;
+  if (e->section) {
+    freeIslands(e);
+    for (r = 0; r < e->placement->regions_size; r++)
+      freeRegion(e, r);
+    LOADER_FREE(e->section);
+    e->section = NULL;
+  }
+  if (e->loadMap) {
+    LOADER_FREE(e->loadMap);
+    e->loadMap = NULL;
+  }
+#ifdef LOADER_METADATA_CACHE
+  freeMetadata(e);
+#endif
+#ifdef LOADER_BLOCK_CACHE_BLOCKS
+  freeBlockCache(e);
+#endif
+#ifdef LOADER_SYMBOL_INDEX
+  if (e->symIndex
+#ifdef LOADER_FLASH_WRITE
+      /* Index of booted modules is in flash */
+      && !e->installed
+#endif
+      )
+    LOADER_FREE(e->symIndex);
+  if (e->fileClosed)
+    return;
+#endif
+  if (!e->image && !IS_STREAM(e))
+    LOADER_CLOSE(e->user_data);
+}
+
+static int relocateSection(ELFExec_t *e, ELFSection_t *s, int n) {
+  DBG("Relocating section %d\n", n);
+  if (s->relSecIdx) {
+    Elf32_Shdr hdrBuf;
+    const Elf32_Shdr *sectHdr = readSecHeader(e, s->relSecIdx, &hdrBuf);
+    if (sectHdr)
+      return relocate(e, sectHdr, s);
+    else {
+      ERR("Error reading section header");
+      return -1;
+    }
+  } else {
+    MSG("No relocation index"); /* Not an error */
+  }
+  return 0;
+}
+
+static int relocateSections(ELFExec_t *e) {
+  int n, ret = 0;
+  for (n = 1; n < e->sections; n++)
+    if (e->section[n].data)
+      ret |= relocateSection(e, &e->section[n], n);
+  return ret;
+}
+
+#ifdef LOADER_STREAM
+/*
+ * Load and relocate a stream in one pass, in file order: section data
+ * goes straight to its final address and is relocated as soon as its
+ * relocation section arrives. .bss needs no input and is cleared first
+ */
+static int streamSections(ELFExec_t *e) {
+  Elf32_Shdr hdrBuf, dataBuf;
+  const Elf32_Shdr *h, *data;
+  off_t lastOff = 0;
+  int last = 0, next, n;
+  for (n = 1; n < e->sections; n++) {
+    h = readSecHeader(e, n, &hdrBuf);
+    if (!h)
+      return -1;
+    if (h->sh_type == SHT_NOBITS && loadSecData(e, &e->section[n], h) != 0)
+      return -1;
+  }
+  for (;;) {
+    off_t nextOff = 0;
+    /* Next section by (offset, index) holding data or used relocations */
+    for (next = 0, n = 1; n < e->sections; n++) {
+      h = readSecHeader(e, n, &hdrBuf);
+      if (!h)
+        return -1;
+      if (!h->sh_size || h->sh_type == SHT_NOBITS)
+        continue;
+      if (h->sh_type == SHT_REL || h->sh_type == SHT_RELA) {
+        if (h->sh_info >= e->sections || e->section[h->sh_info].relSecIdx != n
+            || !e->section[h->sh_info].data)
+          continue;
+      } else if (!e->section[n].data)
+        continue;
+      if (h->sh_offset < lastOff || (h->sh_offset == lastOff && n <= last))
+        continue;
+      if (!next || h->sh_offset < nextOff) {
+        next = n;
+        nextOff = h->sh_offset;
+      }
+    }
+    if (!next)
+      return 0;
+    last = next;
+    lastOff = nextOff;
+    h = readSecHeader(e, next, &hdrBuf);
+    if (h->sh_type != SHT_REL && h->sh_type != SHT_RELA) {
+      DBG("Streaming section %d\n", next);
+      if (loadSecData(e, &e->section[next], h) != 0)
+        return -1;
+      continue;
+    }
+    data = readSecHeader(e, h->sh_info, &dataBuf);
+    if (!data || data->sh_offset > h->sh_offset) {
+      DBG("Relocations of section %d come before its data\n", h->sh_info);
+      return -1;
+    }
+    DBG("Relocating section %d\n", h->sh_info);
+    if (relocate(e, h, &e->section[h->sh_info]) != 0)
+      return -1;
+  }
+}
+#endif
+
+#ifdef LOADER_RELOC_CACHE_GET
+static void digestBytes(Elf32_Word *d, const void *data, size_t size) {
+  const uint8_t *p = data;
+  while (size--) {
+    d[0] = (d[0] ^ *p) * 16777619u;
+    d[1] = ((d[1] << 5) + d[1]) ^ *p++;
+  }
+}
+
+static int digestFile(ELFExec_t *e, off_t off, size_t size) {
+  Elf32_Rel buf[LOADER_REL_BATCH];
+  while (size) {
+    size_t n = size < sizeof(buf) ? size : sizeof(buf);
+    const void *p = readPinned(e, off, buf, n);
+    if (!p)
+      return -1;
+    digestBytes(e->relocDigest, p, n);
+    off += n;
+    size -= n;
+  }
+  return 0;
+}
+
+/*
+ * Digest of everything relocation depends on besides section addresses,
+ * host build and import addresses: section headers, unrelocated data of
+ * relocated sections, relocations, symbols, symbol names and ordinal imports
+ */
+static int relocDigest(ELFExec_t *e) {
+  int n;
+  e->relocDigest[0] = 2166136261u;
+  e->relocDigest[1] = 5381;
+  for (n = 1; n < e->sections; n++) {
+    ELFSection_t *s = &e->section[n];
+    Elf32_Shdr hdrBuf;
+    const Elf32_Shdr *h = readSecHeader(e, n, &hdrBuf);
+    if (!h)
+      return -1;
+    digestBytes(e->relocDigest, h, sizeof(Elf32_Shdr));
+    if (s->data && s->relSecIdx)
+      digestBytes(e->relocDigest, s->data, s->size);
+    if ((h->sh_type == SHT_REL || h->sh_type == SHT_RELA
+        || h->sh_type == SHT_SYMTAB
+        || n == e->strTabIdx
+        || (e->importsSize && h->sh_offset == e->importsOffset))
+        && digestFile(e, h->sh_offset, h->sh_size) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+/*
+ * Fold the addresses the imports of the module resolve to into its digest,
+ * so a host export changed at run time without a new build ID misses the
+ * cache. Ordinal imports are already bound by loadImports; imports by name
+ * are resolved here and kept for relocation on a miss
+ */
+static int importDigest(ELFExec_t *e) {
+  Elf32_Word n;
+  for (n = 1; n < e->symbolCount; n++) {
+    Elf32_Sym symBuf;
+    const Elf32_Sym *sym = readSymbol(e, n, &symBuf);
+    Elf32_Addr addr;
+    if (!sym)
+      return -1;
+    if (sym->st_shndx != SHN_UNDEF || !sym->st_name)
+      continue;
+    if (symResolved(e, n))
+      addr = e->symAddr[n];
+    else {
+      addr = addressOf(e, sym);
+#ifndef LOADER_LAZY_ENTRY
+      /* Lazy imports are bound on first call instead */
+      if (addr != 0xffffffff)
+        setSymResolved(e, n, addr);
+#endif
+    }
+    digestBytes(e->relocDigest, &addr, sizeof(addr));
+  }
+  return 0;
+}
+
+/*
+ * Restore relocated sections from a cache entry of this module, made by
+ * this host build for the same section addresses and import addresses
+ */
+static int relocCacheHit(ELFExec_t *e) {
+  const ELFRelocCacheHeader_t *h = LOADER_RELOC_CACHE_GET(&e->user_data,
+      e->relocDigest[0]);
+  const char *p;
+  Elf32_Word i, loaded = 0;
+  int n;
+  if (!h || h->magic != ELF_RELOC_CACHE_MAGIC
+      || h->digest[0] != e->relocDigest[0] || h->digest[1] != e->relocDigest[1]
+      || h->buildId != LOADER_BUILD_ID(&e->user_data))
+    return 0;
+  for (n = 1; n < e->sections; n++)
+    if (e->section[n].data)
+      loaded++;
+  if (loaded != h->count) {
+    MSG("Relocation cache: sections placed differently");
+    return 0;
+  }
+  for (i = 0, p = (const char *) (h + 1); i < h->count; i++) {
+    const ELFRelocCacheSection_t *cs = (const ELFRelocCacheSection_t *) p;
+    const ELFSection_t *s = sectionOf(e, cs->sec);
+    if (!s || s->addr != cs->addr || s->size != cs->size) {
+      DBG("Relocation cache: section %d moved\n", cs->sec);
+      return 0;
+    }
+    p += sizeof(ELFRelocCacheSection_t) + ((cs->bytes + 3) & ~3);
+  }
+  for (i = 0, p = (const char *) (h + 1); i < h->count; i++) {
+    const ELFRelocCacheSection_t *cs = (const ELFRelocCacheSection_t *) p;
+    if (cs->bytes)
+      LOADER_MEMCPY(e->section[cs->sec].data, cs + 1, cs->bytes);
+    p += sizeof(ELFRelocCacheSection_t) + ((cs->bytes + 3) & ~3);
+  }
+  return 1;
+}
+
+static void relocCachePut(ELFExec_t *e) {
+  ELFRelocCacheHeader_t *h;
+  char *p;
+  size_t size = sizeof(ELFRelocCacheHeader_t);
+  Elf32_Word count = 0, relocated = 0;
+  int n;
+  for (n = 1; n < e->sections; n++)
+    if (e->section[n].data) {
+      size += sizeof(ELFRelocCacheSection_t);
+      if (e->section[n].relSecIdx) {
+        size += (e->section[n].size + 3) & ~3;
+        relocated++;
+      }
+      count++;
+    }
+  if (!relocated)
+    return;
+  h = LOADER_ALIGN_ALLOC(size, 4, ELF_SEC_READ | ELF_SEC_WRITE);
+  if (!h) {
+    MSG("No memory for relocation cache entry");
+    return;
+  }
+  h->magic = ELF_RELOC_CACHE_MAGIC;
+  h->digest[0] = e->relocDigest[0];
+  h->digest[1] = e->relocDigest[1];
+  h->buildId = LOADER_BUILD_ID(&e->user_data);
+  h->count = count;
+  h->size = size;
+  p = (char *) (h + 1);
+  for (n = 1; n < e->sections; n++) {
+    ELFSection_t *s = &e->section[n];
+    ELFRelocCacheSection_t *cs = (ELFRelocCacheSection_t *) p;
+    if (!s->data)
+      continue;
+    cs->sec = n;
+    cs->addr = s->addr;
+    cs->size = s->size;
+    cs->bytes = s->relSecIdx ? s->size : 0;
+    if (cs->bytes)
+      LOADER_MEMCPY(cs + 1, s->data, cs->bytes);
+    p += sizeof(ELFRelocCacheSection_t) + ((cs->bytes + 3) & ~3);
+  }
+  LOADER_RELOC_CACHE_PUT(&e->user_data, h->digest[0], h, size);
+  LOADER_FREE(h);
+}
+#endif
+
+/*
+ * Bind imports and apply relocations, or with a relocation cache copy the
+ * result of a previous load at the same addresses
+ */
+static int relocateModule(ELFExec_t *e) {
+#ifdef LOADER_RELOC_CACHE_GET
+  /* A stream can't be read twice */
+  int digest = !IS_STREAM(e) && relocDigest(e) == 0;
+#endif
+  if (loadImports(e) != 0)
+    return -1;
+#ifdef LOADER_RELOC_CACHE_GET
+  digest = digest && importDigest(e) == 0;
+  if (digest && relocCacheHit(e)) {
+    MSG("Relocated sections from cache");
+    return 0;
+  }
+#endif
+#ifdef LOADER_STREAM
+  if (e->stream)
+    return streamSections(e);
+#endif
+  if (relocateSections(e) != 0)
+    return -1;
+#ifdef LOADER_RELOC_CACHE_GET
+  /* Islands are allocated per load, code branching to them can't be reused */
+  if (digest && !e->veneers
+#ifdef LOADER_LAZY_ENTRY
+      && !e->lazy
+#endif
+      )
+    relocCachePut(e);
+#endif
+  return 0;
+}
+
+int jumpTo(ELFExec_t *e) {
+  entry_t *entry = NULL;
+  if (e->segments) {
+    Elf32_Addr addr = moduleAddress(e, e->entry, 0);
+    if (e->entry && addr != 0xffffffff)
+      entry = (entry_t*) addr;
+  } else if (e->entry && sectionOf(e, e->textIdx))
+    entry = (entry_t*) ((char *) e->section[e->textIdx].data + e->entry);
+  if (entry) {
+#ifdef LOADER_CALL_PIC
+    if (e->picBase)
+      LOADER_CALL_PIC(entry, (void *) e->picBase);
+    else
+#endif
+      LOADER_JUMP_TO(entry);
+    return 0;
   } else {
-    ELFSection_t *symSec = sectionOf(e, sym->st_shndx);
-    if (symSec)
-      return ((Elf32_Addr) symSec->data) + sym->st_value;
+    MSG("No entry defined.");
+    return -1;
+  }
+}
+
+static void runArrays(ELFExec_t *e, ELFSecKind_t kind) {
+  int n, found = 0;
+  for (n = 1; n < e->sections; n++) {
+    ELFSection_t *s = &e->section[n];
+    entry_t **entry = (entry_t**) (s->data);
+    int i;
+    if (s->kind != kind || !s->data)
+      continue;
+    found = 1;
+    for (i = 0; i < s->size >> 2; i++) {
+      DBG("Processing array %d [%d] : %08x->%08x\n", n, i, (int)entry, (int)*entry);
+#ifdef LOADER_CALL_PIC
+      if (e->picBase)
+        LOADER_CALL_PIC(*entry, (void *) e->picBase);
+      else
+#endif
+        (*entry)();
+      entry++;
+    }
+  }
+  if (!found)
+    DBG("No %s_array\n", kind == SecInitArray ? ".init" : ".fini"); // and that's fine
+}
+
+static void do_init(ELFExec_t *e) {
+  runArrays(e, SecInitArray);
+}
+
+static void do_fini(ELFExec_t *e) {
+  runArrays(e, SecFiniArray);
+}
+
+void* get_sym(ELFExec_t *exec, const char *sym_name, int symbol_type) {
+  int i;
+  entry_t *addr = 0;
+#ifdef LOADER_SYMBOL_INDEX
+  if (exec->symIndex
+      && (symbol_type == STT_FUNC || symbol_type == STT_OBJECT)) {
+    addr = (entry_t *) findIndexedSymbol(exec, sym_name, symbol_type);
+    /* Local functions and objects are only in the symbol table */
+    if (addr || !symtabAvailable(exec))
+      return addr;
+  }
+  if (!symtabAvailable(exec)) {
+    DBG("sym \"%s\" not indexed and file closed\n", sym_name);
+    return 0;
+  }
+#endif
+  for (i = 0; i < exec->symbolCount; i++) {
+    Elf32_Sym symBuf;
+    off_t pos = exec->symbolTable + i * sizeof(Elf32_Sym);
+    const Elf32_Sym *sym = readPinned(exec, pos, &symBuf, sizeof(Elf32_Sym));
+    if (!sym) {
+      MSG("read symbol err");
+      break;
+    }
+    if (sym->st_name && (ELF32_ST_TYPE(sym->st_info) == symbol_type)
+        && nameEq(exec, sym->st_name, sym_name)) {
+      Elf32_Addr symAddr = definedAddress(exec, sym);
+      if (symAddr != 0xffffffff) {
+        addr = (entry_t*) symAddr;
+        DBG("sym \"%s\" found @ %08x\n", sym_name, addr);
+        break;
+      } else if (symbol_type == STT_NOTYPE) {
+        addr = (entry_t*) sym->st_value;
+        DBG("sym \"%s\" found @ %08x\n", sym_name, addr);
+        break;
+      }
+    }
+  }
+  if (!addr) {
+    DBG("sym \"%s\" not found\n", sym_name);
+  }
+  return addr;
+}
+
+uint32_t elf_name_hash_seed(const char *name, uint32_t seed) {
+  uint32_t h = 2166136261u ^ seed;
+  while (*name) {
+    h ^= (uint8_t) *name++;
+    h *= 16777619u;
+  }
+  /* FNV low bits are weak, mix before tables use them as modulus */
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  return h;
+}
+
+uint32_t elf_name_hash(const char *name) {
+  return elf_name_hash_seed(name, 0);
+}
+
+uint32_t elf_name_hash_stream(const ELFName_t *name, uint32_t seed,
+    size_t *len) {
+  char buf[LOADER_NAME_CHUNK];
+  uint32_t h = 2166136261u ^ seed;
+  off_t off = name->offset;
+  for (;;) {
+    size_t avail, i;
+    const char *p = readChunk(name->exec, off, buf, &avail);
+    if (!p)
+      break;
+    for (i = 0; i < avail && p[i]; i++) {
+      h ^= (uint8_t) p[i];
+      h *= 16777619u;
+    }
+    off += i;
+    if (i < avail)
+      break;
+  }
+  if (len)
+    *len = off - name->offset;
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  return h;
+}
+
+int elf_name_eq(const ELFName_t *name, const char *str) {
+  return stringEq(name->exec, name->offset, str);
+}
+
+int elf_name_eq_at(const ELFName_t *name, size_t pos, const char *str,
+    size_t len) {
+  return nameCompare(name->exec, name->offset + pos, str, len);
+}
+
+void *get_pic_base(ELFExec_t *exec) {
+  return (void *) exec->picBase;
+}
+
+int get_cache_stats(ELFExec_t *exec, ELFCacheStats_t *stats) {
+#ifdef LOADER_BLOCK_CACHE_BLOCKS
+  stats->hits = exec->cacheHits;
+  stats->misses = exec->cacheMisses;
+  return 0;
+#else
+  stats->hits = 0;
+  stats->misses = 0;
+  return -1;
+#endif
+}
+
+void* get_obj(ELFExec_t *exec, const char *obj_name) {
+  return get_sym(exec, obj_name, STT_OBJECT);
+}
+
+void* get_func(ELFExec_t *exec, const char *func_name) {
+  return get_sym(exec, func_name, STT_FUNC);
+}
+
+static void clearELFExec(ELFExec_t *e) {
+  char *c = (char *)e;
+  int i;
+  for(i=0;i<sizeof(ELFExec_t);i++){
+    *c++=0;
+  }
+}
+
+/*
+ * Apply relocation stream of a segment. Targets are segments, then the
+ * imports resolved in symAddr
+ */
+static int relocateCompact(ELFExec_t *e, ELFSection_t *s, off_t off,
+    Elf32_Word count, Elf32_Word nSegs) {
+  Elf32_Word recBuf[LOADER_REL_BATCH];
+  Elf32_Word first, n, i, type = R_ARM_NONE, target = 0;
+  Elf32_Word where = 0;
+  Elf32_Sword addend = 0;
+  int addendState = 0; /* 1: next word is an addend, 2: addend read */
+  for (first = 0; first < count; first += n) {
+    const Elf32_Word *rec;
+    n = count - first;
+    if (n > LOADER_REL_BATCH)
+      n = LOADER_REL_BATCH;
+    rec = readPinned(e, off + first * sizeof(Elf32_Word), recBuf,
+        n * sizeof(Elf32_Word));
+    if (!rec)
+      return -1;
+    for (i = 0; i < n; i++) {
+      Elf32_Word repeat = 1;
+      Elf32_Addr symAddr;
+      if (addendState == 1) {
+        addend = rec[i];
+        addendState = 2;
+        continue;
+      }
+      if (COMPACT_REL_TYPE(rec[i]) != R_ARM_NONE) {
+        type = COMPACT_REL_TYPE(rec[i]);
+        target = COMPACT_REL_ARG(rec[i]);
+      } else if (!COMPACT_REL_ARG(rec[i])
+          || COMPACT_REL_ARG(rec[i]) == COMPACT_REL_ADDEND) {
+        where += COMPACT_REL_DELTA(rec[i]);
+        if (COMPACT_REL_ARG(rec[i]))
+          addendState = 1;
+        continue;
+      } else
+        repeat = COMPACT_REL_ARG(rec[i]);
+      if (target >= nSegs + e->symbolCount) {
+        ERR("Bad relocation target %d", target);
+        return -1;
+      }
+      symAddr = target < nSegs ? e->section[1 + target].addr
+          : e->symAddr[target - nSegs];
+      while (repeat--) {
+        where += COMPACT_REL_DELTA(rec[i]);
+        if (where + fieldSize(type) > s->size || relocateCode(e, s,
+            (Elf32_Addr) s->data + where, s->addr + where, type, symAddr,
+            addendState ? &addend : NULL) != 0) {
+          ERR("relocate failed at %08x, type %d", where, type);
+          return -1;
+        }
+        addendState = 0;
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+ * Load module in compact format (tools/mkcompact.py): one allocation and
+ * one read per segment, imports resolved once, then one pass over
+ * pre-sorted relocation streams
+ */
+static int loadCompact(ELFExec_t *e) {
+  ELFCompactHeader_t hBuf;
+  const ELFCompactHeader_t *h = readPinned(e, 0, &hBuf, sizeof(hBuf));
+  Elf32_Word i, nSegs;
+  off_t names, off;
+  if (!h)
+    return -1;
+  if (h != &hBuf)
+    hBuf = *h;
+  h = &hBuf;
+#ifdef LOADER_FLASH_WRITE
+  if (e->install) {
+    MSG("Compact modules can't be installed");
+    return -1;
+  }
+#endif
+  nSegs = h->segments;
+  e->sections = 1 + nSegs + h->arrays;
+  initPlacement(e);
+  if (allocSectionTable(e) != 0)
+    return -1;
+  names = sizeof(ELFCompactHeader_t) + nSegs * sizeof(ELFCompactSegment_t)
+      + h->arrays * sizeof(ELFCompactArray_t) + h->imports * sizeof(Elf32_Word);
+  for (i = 0; i < nSegs; i++) {
+    ELFCompactSegment_t segBuf;
+    const ELFCompactSegment_t *seg = readPinned(e, sizeof(ELFCompactHeader_t)
+        + i * sizeof(ELFCompactSegment_t), &segBuf, sizeof(segBuf));
+    ELFSection_t *sec = &e->section[1 + i];
+    char nameBuf[LOADER_MAX_SYM_LENGTH];
+    const char *name;
+    int r;
+    if (!seg)
+      return -1;
+    name = readString(e, names + seg->name, nameBuf, sizeof(nameBuf));
+    r = name ? regionByName(e, name) : -1;
+    sec->size = seg->size;
+    sec->align = seg->align;
+    sec->perm = seg->perm;
+    sec->region = r < 0 ? 0 : r;
+    DBG("Segment %d: %d bytes to %s\n", i, seg->size,
+        e->placement->regions[sec->region].name);
+  }
+  if (allocRegions(e) != 0)
+    return -1;
+
+  off = names + h->namesSize;
+  for (i = 0; i < nSegs; i++) {
+    ELFCompactSegment_t segBuf;
+    const ELFCompactSegment_t *seg = readPinned(e, sizeof(ELFCompactHeader_t)
+        + i * sizeof(ELFCompactSegment_t), &segBuf, sizeof(segBuf));
+    char *data = e->section[1 + i].data;
+    const char *src;
+    Elf32_Word j;
+    if (!seg || seg->fileSize > seg->size)
+      return -1;
+    src = readAt(e, off, data, seg->fileSize);
+    if (!src)
+      return -1;
+    if (src != data)
+      LOADER_MEMCPY(data, src, seg->fileSize);
+    for (j = seg->fileSize; j < seg->size; j++)
+      data[j] = 0;
+    off += (seg->fileSize + 3) & ~3;
+  }
+
+  for (i = 0; i < h->arrays; i++) {
+    ELFCompactArray_t arrBuf;
+    const ELFCompactArray_t *arr = readPinned(e, sizeof(ELFCompactHeader_t)
+        + nSegs * sizeof(ELFCompactSegment_t) + i * sizeof(ELFCompactArray_t),
+        &arrBuf, sizeof(arrBuf));
+    ELFSection_t *sec = &e->section[1 + nSegs + i];
+    if (!arr || arr->seg >= nSegs
+        || (arr->kind != SecInitArray && arr->kind != SecFiniArray)
+        || arr->offset + arr->size > e->section[1 + arr->seg].size)
+      return -1;
+    sec->data = (char *) e->section[1 + arr->seg].data + arr->offset;
+    sec->addr = (Elf32_Addr) sec->data;
+    sec->size = arr->size;
+    sec->kind = arr->kind;
+  }
+
+  /* Resolved imports, indexed by relocation target minus segments */
+  e->symbolCount = h->imports;
+  if (h->imports) {
+    e->symAddr = LOADER_ALIGN_ALLOC(h->imports * sizeof(Elf32_Addr), 4,
+        ELF_SEC_READ | ELF_SEC_WRITE);
+    if (!e->symAddr) {
+      MSG("No memory for imports");
+      return -1;
+    }
+  }
+  for (i = 0; i < h->imports; i++) {
+    Elf32_Word impBuf;
+    const Elf32_Word *imp = readPinned(e, names - (h->imports - i)
+        * sizeof(Elf32_Word), &impBuf, sizeof(impBuf));
+    if (!imp)
+      return -1;
+    if (*imp & COMPACT_IMPORT_ORDINAL)
+      e->symAddr[i] = LOADER_GETIMPORTADDR(&e->user_data, h->abiHash,
+          *imp & ~COMPACT_IMPORT_ORDINAL);
+    else {
+      ELFName_t name;
+      name.exec = e;
+      name.offset = names + *imp;
+      e->symAddr[i] = LOADER_GETUNDEFSYMADDR(&e->user_data, &name);
+    }
+    if (e->symAddr[i] == 0xffffffff) {
+      DBG("  Import %d not resolved\n", i);
+      return -1;
+    }
+  }
+
+  for (i = 0; i < nSegs; i++) {
+    ELFCompactSegment_t segBuf;
+    const ELFCompactSegment_t *seg = readPinned(e, sizeof(ELFCompactHeader_t)
+        + i * sizeof(ELFCompactSegment_t), &segBuf, sizeof(segBuf));
+    if (!seg || relocateCompact(e, &e->section[1 + i], off, seg->relocs,
+        nSegs) != 0)
+      return -1;
+    off += seg->relocs * sizeof(Elf32_Word);
+  }
+  freeSymTable(e);
+  e->symbolCount = 0;
+
+  if (h->entrySeg < nSegs) {
+    e->textIdx = 1 + h->entrySeg;
+    e->entry = h->entry;
+  }
+#ifdef LOADER_SYMBOL_INDEX
+  if (h->indexSlots) {
+    size_t size = h->indexSlots * sizeof(ELFSymIndexSlot_t) + h->indexNames;
+    ELFSymIndexSlot_t *slots = LOADER_ALIGN_ALLOC(size, 4,
+        ELF_SEC_READ | ELF_SEC_WRITE);
+    const void *src = slots ? readAt(e, off, slots, size) : NULL;
+    if (!src || (h->indexSlots & (h->indexSlots - 1))) {
+      MSG("No symbol index");
+      if (slots)
+        LOADER_FREE(slots);
+      return 0;
+    }
+    if (src != slots)
+      LOADER_MEMCPY(slots, src, size);
+    /* Addresses are segment index (top byte) and offset */
+    for (i = 0; i < h->indexSlots; i++)
+      if (slots[i].name) {
+        Elf32_Word seg = slots[i].addr >> 24;
+        slots[i].addr = seg < nSegs
+            ? e->section[1 + seg].addr + (slots[i].addr & 0xffffff) : 0;
+      }
+    e->symIndex = slots;
+    e->symIndexSize = h->indexSlots;
+    e->symIndexNames = h->indexNames;
+  }
+#endif
+  return 0;
+}
+
+static int isCompact(ELFExec_t *e) {
+  Elf32_Word magicBuf;
+  const Elf32_Word *magic = readPinned(e, 0, &magicBuf, sizeof(magicBuf));
+  return magic && *magic == ELF_COMPACT_MAGIC;
+}
+
+static ELFSecPerm_t segmentPerm(Elf32_Word flags) {
+  return ((flags & PF_R) ? ELF_SEC_READ : 0)
+      | ((flags & PF_W) ? ELF_SEC_WRITE : 0)
+      | ((flags & PF_X) ? ELF_SEC_EXEC : 0);
+}
+
+/*
+ * File offset of a module address, through the PT_LOAD segment holding it
+ */
+static off_t segmentOffset(ELFExec_t *e, const Elf32_Phdr *ph,
+    Elf32_Addr addr) {
+  int n;
+  for (n = 0; n < e->segments; n++)
+    if (ph[n].p_type == PT_LOAD && addr >= ph[n].p_vaddr
+        && addr - ph[n].p_vaddr < ph[n].p_filesz)
+      return ph[n].p_offset + (addr - ph[n].p_vaddr);
+  return -1;
+}
+
+/*
+ * Dynamic section entries up to DT_FINI_ARRAYSZ, read from the file.
+ * DT_TEXTREL has no value, its entry is set to 1 when present
+ */
+static int readDynamic(ELFExec_t *e, const Elf32_Phdr *ph, Elf32_Word *dyn) {
+  Elf32_Dyn dynBuf[LOADER_REL_BATCH];
+  size_t entries = 0, first, count, i;
+  off_t off = 0;
+  int n;
+  for (i = 0; i <= DT_FINI_ARRAYSZ; i++)
+    dyn[i] = 0;
+  for (n = 0; n < e->segments; n++)
+    if (ph[n].p_type == PT_DYNAMIC) {
+      off = ph[n].p_offset;
+      entries = ph[n].p_filesz / sizeof(Elf32_Dyn);
+    }
+  for (first = 0; first < entries; first += count) {
+    const Elf32_Dyn *d;
+    count = entries - first;
+    if (count > LOADER_REL_BATCH)
+      count = LOADER_REL_BATCH;
+    d = readPinned(e, off + first * sizeof(Elf32_Dyn), dynBuf,
+        count * sizeof(Elf32_Dyn));
+    if (!d) {
+      ERR("read dynamic section failed");
+      return -1;
+    }
+    for (i = 0; i < count; i++) {
+      if (d[i].d_tag == DT_NULL)
+        return 0;
+      if (d[i].d_tag > DT_NULL && d[i].d_tag <= DT_FINI_ARRAYSZ)
+        dyn[d[i].d_tag] = d[i].d_tag == DT_TEXTREL ? 1 : d[i].d_un.d_val;
+    }
+  }
+  return 0;
+}
+
+static const Elf32_Word *readWord(ELFExec_t *e, const Elf32_Phdr *ph,
+    Elf32_Addr addr, Elf32_Word *buf) {
+  off_t off = segmentOffset(e, ph, addr);
+  return off < 0 || (addr & 3) ? NULL : readPinned(e, off, buf, sizeof(*buf));
+}
+
+static uint32_t elfHash(const char *name) {
+  uint32_t h = 0, g;
+  while (*name) {
+    h = (h << 4) + (uint8_t) *name++;
+    g = h & 0xf0000000;
+    h ^= g >> 24;
+    h &= ~g;
   }
-  DBG("  Can't find address for symbol %s\n", sName);
-  return 0xffffffff;
+  return h;
 }
 
-static int relocate(ELFExec_t *e, Elf32_Shdr *h, ELFSection_t *s,
-    const char *name) {
-  if (s->data) {
-    Elf32_Rel rel;
-    size_t relEntries = h->sh_size / sizeof(rel);
-    size_t relCount;
-    (void) LOADER_SEEK_FROM_START(e->user_data, h->sh_offset);
-    DBG(" Offset   Info     Type             Name\n");
-    for (relCount = 0; relCount < relEntries; relCount++) {
-      if (LOADER_READ(e->user_data, &rel, sizeof(rel)) == sizeof(rel)) {
-        Elf32_Sym sym;
-        Elf32_Addr symAddr;
-
-        char name[LOADER_MAX_SYM_LENGTH] = "<unnamed>";
-        int symEntry = ELF32_R_SYM(rel.r_info);
-        int relType = ELF32_R_TYPE(rel.r_info);
-        Elf32_Addr relAddr = ((Elf32_Addr) s->data) + rel.r_offset;
-
-        readSymbol(e, symEntry, &sym, name, sizeof(name));
-        DBG(" %08X %08X %-16s %s\n", rel.r_offset, rel.r_info, typeStr(relType),
-            name);
-
-        symAddr = addressOf(e, &sym, name);
-        if (symAddr != 0xffffffff) {
-          DBG("  symAddr=%08X relAddr=%08X\n", symAddr, relAddr);
-          if (relocateSymbol(relAddr, relType, symAddr) == -1) {
-            ERR("relocate failed of sym %s, type %d", name, relType);
-            return -1;
-          }
-        } else {
-          DBG("  No symbol address of %s\n", name);
-          return -1;
-        }
-      }
-    }
+/*
+ * Module address of a defined dynamic symbol, found through the SysV hash
+ * table (DT_HASH). 0 if not found
+ */
+static Elf32_Addr hashLookup(ELFExec_t *e, const Elf32_Phdr *ph,
+    Elf32_Addr hash, const char *name) {
+  Elf32_Word buf, nBucket, nChain, n;
+  const Elf32_Word *w;
+  int steps;
+  if (!hash || !(w = readWord(e, ph, hash, &buf)) || !(nBucket = *w)
+      || !(w = readWord(e, ph, hash + 4, &buf)))
     return 0;
-  } else {
-    MSG("Section not loaded");
+  nChain = *w;
+  w = readWord(e, ph, hash + 8 + (elfHash(name) % nBucket) * 4, &buf);
+  for (n = w ? *w : 0, steps = 0; n && n < nChain && steps < nChain; steps++) {
+    Elf32_Sym symBuf;
+    const Elf32_Sym *sym = readSymbol(e, n, &symBuf);
+    if (!sym)
+      return 0;
+    if (sym->st_name && sym->st_shndx != SHN_UNDEF
+        && sym->st_shndx < SHN_LORESERVE && nameEq(e, sym->st_name, name))
+      return sym->st_value;
+    w = readWord(e, ph, hash + 8 + (nBucket + n) * 4, &buf);
+    n = w ? *w : 0;
   }
-  return -1;
+  return 0;
 }
 
-static int placeInfo(ELFExec_t *e, Elf32_Shdr *sh, const char *name, int n) {
-  if (LOADER_STREQ(name, ".symtab")) {
-    e->symbolTable = sh->sh_offset;
-    e->symbolCount = sh->sh_size / sizeof(Elf32_Sym);
-    return FoundSymTab;
-  } else if (LOADER_STREQ(name, ".strtab")) {
-    e->symbolTableStrings = sh->sh_offset;
-    return FoundStrTab;
-  } else if (LOADER_STREQ(name, ".text")) {
-    if (loadSecData(e, &e->text, sh, sram) == -1)
-      return FoundERROR;
-    e->text.secIdx = n;
-    return FoundText;
-  } else if (LOADER_STREQ(name, ".rodata")) {
-    if (loadSecData(e, &e->rodata, sh, sram) == -1)
-      return FoundERROR;
-    e->rodata.secIdx = n;
-    return FoundRodata;
-  } else if (LOADER_STREQ(name, ".data")) {
-    if (loadSecData(e, &e->data, sh, sram) == -1)
-      return FoundERROR;
-    e->data.secIdx = n;
-    return FoundData;
-  } else if (LOADER_STREQ(name, ".bss")) {
-    if (loadSecData(e, &e->bss, sh, sram) == -1)
-      return FoundERROR;
-    e->bss.secIdx = n;
-    return FoundBss;
-  } else if (LOADER_STREQ(name, ".sdram_rodata")) {
-    if (loadSecData(e, &e->sdram_rodata, sh, sdram) == -1)
-      return FoundERROR;
-    e->sdram_rodata.secIdx = n;
-    return FoundSDRamRodata;
-  } else if (LOADER_STREQ(name, ".sdram_data")) {
-    if (loadSecData(e, &e->sdram_data, sh, sdram) == -1)
-      return FoundERROR;
-    e->sdram_data.secIdx = n;
-    return FoundSDRamData;
-  } else if (LOADER_STREQ(name, ".sdram_bss")) {
-    if (loadSecData(e, &e->sdram_bss, sh, sdram) == -1)
-      return FoundERROR;
-    e->sdram_bss.secIdx = n;
-    return FoundSDRamBss;
-  } else if (LOADER_STREQ(name, ".init_array")) {
-    if (loadSecData(e, &e->init_array, sh, sram) == -1)
-      return FoundERROR;
-    e->init_array.secIdx = n;
-    return FoundInitArray;
-  } else if (LOADER_STREQ(name, ".fini_array")) {
-    if (loadSecData(e, &e->fini_array, sh, sram) == -1)
-      return FoundERROR;
-    e->fini_array.secIdx = n;
-    e->fini_array_size = sh->sh_size;
-    return FoundFiniArray;
-  } else if (LOADER_STREQ(name, ".rel.text")) {
-    e->text.relSecIdx = n;
-    return FoundRelText;
-  } else if (LOADER_STREQ(name, ".rel.rodata")) {
-    e->rodata.relSecIdx = n;
-    return FoundRelRodata;
-  } else if (LOADER_STREQ(name, ".rel.data")) {
-    e->data.relSecIdx = n;
-    return FoundRelData;
-  } else if (LOADER_STREQ(name, ".rel.sdram_rodata")) {
-    e->sdram_rodata.relSecIdx = n;
-    return FoundRelSDRamRodata;
-  } else if (LOADER_STREQ(name, ".rel.sdram_data")) {
-    e->sdram_data.relSecIdx = n;
-    return FoundRelSDRamData;
-  } else if (LOADER_STREQ(name, ".rel.init_array")) {
-    e->init_array.relSecIdx = n;
-    return FoundRelInitArray;
-  } else if (LOADER_STREQ(name, ".rel.fini_array")) {
-    e->fini_array.relSecIdx = n;
-    return FoundRelFiniArray;
-  }
-  /* BSS not need relocation */
-#if 0
-  else if (LOADER_STREQ(name, ".rel.bss")) {
-    e->bss.relSecIdx = n;
-    return FoundRelText;
+/*
+ * Read-only segments of a PIC module run from a mapped image when their
+ * file contents are all they need: every access to data goes through the
+ * GOT (PIC base register), not PC relative, so they don't have to keep
+ * their distance to the segments loaded to RAM
+ */
+static int runsInPlace(ELFExec_t *e, const Elf32_Phdr *p, int pic,
+    int textRel) {
+  Elf32_Word align = p->p_align ? p->p_align : 1;
+  return e->xip && pic && !textRel && !(p->p_flags & PF_W)
+      && p->p_filesz == p->p_memsz && !(align & (align - 1))
+      && !((Elf32_Addr) (e->image + p->p_offset - p->p_vaddr) & (align - 1));
+}
+
+static int mapArray(ELFExec_t *e, int n, ELFSecKind_t kind, Elf32_Addr addr,
+    Elf32_Word size) {
+  ELFSection_t *s = &e->section[n];
+  Elf32_Addr run;
+  if (!size)
+    return 0;
+  run = moduleAddress(e, addr, size);
+  if (run == 0xffffffff || (run & 3)) {
+    ERR("Bad %s array", kind == SecInitArray ? "init" : "fini");
+    return -1;
   }
-#endif
+  s->data = (void *) run;
+  s->addr = run;
+  s->size = size;
+  s->kind = kind;
   return 0;
 }
 
-static int loadSymbols(ELFExec_t *e) {
-  int n;
-  int founded = 0;
-  MSG("Scan ELF indexes...");
-  for (n = 1; n < e->sections; n++) {
-    Elf32_Shdr sectHdr;
-    char name[LOADER_MAX_SYM_LENGTH] = "<unamed>";
-    if (readSecHeader(e, n, &sectHdr) != 0) {
-      ERR("Error reading section");
+/*
+ * Dynamic relocations patch words of the segments loaded to RAM: GOT
+ * entries, data pointers and init/fini arrays. R_ARM_RELATIVE holds a
+ * module address, mapped through the load map
+ */
+static int relocateDynamic(ELFExec_t *e, const Elf32_Phdr *ph,
+    Elf32_Addr addr, Elf32_Word size) {
+  const ELFSection_t *ram = &e->section[LinkedRam];
+  Elf32_Rel relBuf[LOADER_REL_BATCH];
+  Elf32_Word symIdx[LOADER_REL_BATCH];
+  Elf32_Addr symAddr[LOADER_REL_BATCH];
+  size_t relEntries = size / sizeof(Elf32_Rel);
+  size_t first, count, i;
+  off_t off;
+  if (!size)
+    return 0;
+  off = segmentOffset(e, ph, addr);
+  if (off < 0) {
+    ERR("Relocations outside of the file");
+    return -1;
+  }
+  DBG(" Offset   Info     Type             Name\n");
+  for (first = 0; first < relEntries; first += count) {
+    const Elf32_Rel *rel;
+    int nSyms, j;
+    count = relEntries - first;
+    if (count > LOADER_REL_BATCH)
+      count = LOADER_REL_BATCH;
+    rel = readPinned(e, off + first * sizeof(Elf32_Rel), relBuf,
+        count * sizeof(Elf32_Rel));
+    if (!rel) {
+      ERR("read relocations failed");
       return -1;
     }
-    if (sectHdr.sh_name)
-      readSectionName(e, sectHdr.sh_name, name, sizeof(name));
-    DBG("Examining section %d %s\n", n, name);
-    founded |= placeInfo(e, &sectHdr, name, n);
-    if (IS_FLAGS_SET(founded, FoundAll))
-      return FoundAll;
+    nSyms = resolveBatch(e, NULL, rel, count, sizeof(Elf32_Rel), symIdx,
+        symAddr);
+    if (nSyms < 0)
+      return -1;
+
+    for (i = 0; i < count; i++) {
+      int relType = ELF32_R_TYPE(rel[i].r_info);
+      Elf32_Addr place = moduleAddress(e, rel[i].r_offset, 4);
+      j = findBatchSymbol(symIdx, nSyms, ELF32_R_SYM(rel[i].r_info));
+      DBG(" %08X %08X %-16s %d\n", rel[i].r_offset, rel[i].r_info,
+          typeStr(relType), symIdx[j]);
+      if (place == 0xffffffff || !ram->data || place < ram->addr
+          || place - ram->addr > ram->size - 4) {
+        ERR("Relocation %08x not in RAM", rel[i].r_offset);
+        return -1;
+      }
+      if (relType == R_ARM_RELATIVE) {
+        *((uint32_t*) place) = moduleAddress(e, *((uint32_t*) place), 0);
+        if (*((uint32_t*) place) == 0xffffffff) {
+          ERR("R_ARM_RELATIVE outside of module at %08x", rel[i].r_offset);
+          return -1;
+        }
+      } else if (relocateSymbol(place, place, relType, symAddr[j], NULL)
+          == -1) {
+        ERR("relocate failed of sym %d, type %d", symIdx[j], relType);
+        return -1;
+      }
+    }
   }
-  MSG("Done");
-  return founded;
+  return 0;
 }
 
-static int initElf(ELFExec_t *e) {
-  Elf32_Ehdr h;
-  Elf32_Shdr sH;
+static int mapSegments(ELFExec_t *e, const Elf32_Phdr *ph) {
+  Elf32_Word dyn[DT_FINI_ARRAYSZ + 1];
+  Elf32_Addr lo = 0xffffffff, hi = 0, got;
+  Elf32_Word align = 4;
+  ELFSection_t *ram;
+  Elf32_Shdr sh;
+  int n, m, ret;
+  if (readDynamic(e, ph, dyn) != 0)
+    return -1;
+  if (dyn[DT_RELA] || (dyn[DT_PLTREL] && dyn[DT_PLTREL] != DT_REL)) {
+    ERR("RELA relocations not supported");
+    return -1;
+  }
+  if (dyn[DT_SYMTAB]) {
+    off_t symtab = segmentOffset(e, ph, dyn[DT_SYMTAB]);
+    off_t strtab = segmentOffset(e, ph, dyn[DT_STRTAB]);
+    Elf32_Word buf;
+    const Elf32_Word *nChain = dyn[DT_HASH]
+        ? readWord(e, ph, dyn[DT_HASH] + 4, &buf) : NULL;
+    if (symtab < 0 || strtab < 0) {
+      ERR("Dynamic symbols outside of the file");
+      return -1;
+    }
+    e->symbolTable = symtab;
+    e->symbolTableStrings = strtab;
+    /* Symbol count is the chain count of the hash table */
+    if (nChain)
+      e->symbolCount = *nChain;
+    else if (dyn[DT_STRTAB] > dyn[DT_SYMTAB])
+      e->symbolCount = (dyn[DT_STRTAB] - dyn[DT_SYMTAB]) / sizeof(Elf32_Sym);
+  }
+  /* PIC base: GOT origin exported by the module, else DT_PLTGOT */
+  got = hashLookup(e, ph, dyn[DT_HASH], "__elfloader_got");
 
-  if (!LOADER_FD_VALID(e->user_data))
+  sh.sh_flags = 0;
+  for (n = 0; n < e->segments; n++) {
+    if (ph[n].p_type != PT_LOAD || !ph[n].p_memsz)
+      continue;
+    if (ph[n].p_filesz > ph[n].p_memsz
+        || ph[n].p_vaddr + ph[n].p_memsz < ph[n].p_vaddr) {
+      ERR("Bad segment %d", n);
+      return -1;
+    }
+    e->loadMapSize++;
+    if (runsInPlace(e, &ph[n], got != 0, dyn[DT_TEXTREL]))
+      continue;
+    if (ph[n].p_vaddr < lo)
+      lo = ph[n].p_vaddr;
+    if (ph[n].p_vaddr + ph[n].p_memsz > hi)
+      hi = ph[n].p_vaddr + ph[n].p_memsz;
+    if (ph[n].p_align > align)
+      align = ph[n].p_align;
+    sh.sh_flags |= segmentPerm(ph[n].p_flags);
+  }
+  if (!e->loadMapSize || (align & (align - 1))) {
+    MSG("No loadable segment");
     return -1;
+  }
+  if (hi > lo)
+    lo &= ~(align - 1);
+  else
+    lo = hi = 0;
+  e->loadMap = LOADER_ALIGN_ALLOC(e->loadMapSize * sizeof(ELFLoadSegment_t),
+      4, ELF_SEC_READ | ELF_SEC_WRITE);
+  if (!e->loadMap) {
+    MSG("No memory for load map");
+    return -1;
+  }
 
-  if (LOADER_READ(e->user_data, &h, sizeof(h)) != sizeof(h))
+  /* Block of the segments loaded to RAM, then .init_array and .fini_array */
+  e->sections = LinkedSections;
+  initPlacement(e);
+  if (allocSectionTable(e) != 0)
+    return -1;
+  ram = &e->section[LinkedRam];
+  sh.sh_size = hi - lo;
+  ram->size = sh.sh_size;
+  ram->perm = sh.sh_flags;
+  ram->region = placeSection(e, "", &sh);
+  for (ram->align = 0; align > 1; align >>= 1)
+    ram->align++;
+  if (allocRegions(e) != 0)
     return -1;
+  for (n = 0, m = 0; n < e->segments; n++) {
+    ELFLoadSegment_t *seg = &e->loadMap[m];
+    char *data;
+    if (ph[n].p_type != PT_LOAD || !ph[n].p_memsz)
+      continue;
+    seg->vaddr = ph[n].p_vaddr;
+    seg->memsz = ph[n].p_memsz;
+    m++;
+    if (runsInPlace(e, &ph[n], got != 0, dyn[DT_TEXTREL])) {
+      seg->addr = (Elf32_Addr) (e->image + ph[n].p_offset);
+      DBG("Segment %d in place @ %08x\n", n, seg->addr);
+      continue;
+    }
+    data = (char *) ram->data + (ph[n].p_vaddr - lo);
+    seg->addr = ram->addr + (ph[n].p_vaddr - lo);
+    if (ph[n].p_filesz) {
+      const void *src = readAt(e, ph[n].p_offset, data, ph[n].p_filesz);
+      if (!src) {
+        ERR("     read data fail");
+        return -1;
+      }
+      if (src != data)
+        LOADER_MEMCPY(data, src, ph[n].p_filesz);
+    }
+    LOADER_CLEAR(data + ph[n].p_filesz, ph[n].p_memsz - ph[n].p_filesz);
+  }
+  if (got)
+    e->picBase = moduleAddress(e, got, 0);
+  else if (dyn[DT_PLTGOT])
+    e->picBase = moduleAddress(e, dyn[DT_PLTGOT], 0);
+  if (e->picBase == 0xffffffff) {
+    ERR("PIC base outside of module");
+    return -1;
+  }
+  if (mapArray(e, LinkedInit, SecInitArray, dyn[DT_INIT_ARRAY],
+      dyn[DT_INIT_ARRAYSZ]) != 0
+      || mapArray(e, LinkedFini, SecFiniArray, dyn[DT_FINI_ARRAY],
+      dyn[DT_FINI_ARRAYSZ]) != 0)
+    return -1;
+  DBG("Linked module: %d bytes in RAM, %d dynamic symbols, PIC base %08x\n",
+      hi - lo, e->symbolCount, e->picBase);
 
-  const char elfmagic[EI_MAGIC_SIZE] = EI_MAGIC;
-  if (h.e_ident[EI_MAG0] != elfmagic[EI_MAG0]) return 1;
-  if (h.e_ident[EI_MAG1] != elfmagic[EI_MAG1]) return 1;
-  if (h.e_ident[EI_MAG2] != elfmagic[EI_MAG2]) return 1;
-  if (h.e_ident[EI_MAG3] != elfmagic[EI_MAG3]) return 1;
-  if (h.e_ident[EI_CLASS] != ELFCLASS32) return 1;
-  if (h.e_type != ET_REL) return 1;
-  if (h.e_machine != EM_ARM) return 1;
-  if (h.e_version != EV_CURRENT) return 1;
+  initSymTable(e);
+  ret = relocateDynamic(e, ph, dyn[DT_REL], dyn[DT_RELSZ]) != 0
+      || relocateDynamic(e, ph, dyn[DT_JMPREL], dyn[DT_PLTRELSZ]) != 0;
+  freeSymTable(e);
+  return ret ? -1 : 0;
+}
 
-  if (LOADER_SEEK_FROM_START(e->user_data, h.e_shoff + h.e_shstrndx * sizeof(sH)) != 0)
+/*
+ * Load linked module (ET_DYN, or ET_EXEC linked at 0) through its program
+ * headers: the PT_LOAD segments are read to one block keeping their
+ * relative addresses, so references between them need no relocation, and
+ * only the dynamic relocations (.rel.dyn, .rel.plt) are applied. Symbols
+ * come from the dynamic symbol table
+ */
+static int loadSegments(ELFExec_t *e) {
+  size_t size = e->segments * sizeof(Elf32_Phdr);
+  Elf32_Phdr *ph;
+  const void *src;
+  int ret = -1;
+#ifdef LOADER_FLASH_WRITE
+  if (e->install) {
+    MSG("Linked modules can't be installed");
     return -1;
-  if (LOADER_READ(e->user_data, &sH, sizeof(Elf32_Shdr)) != sizeof(Elf32_Shdr))
+  }
+#endif
+  ph = LOADER_ALIGN_ALLOC(size, 4, ELF_SEC_READ | ELF_SEC_WRITE);
+  if (!ph) {
+    MSG("No memory for program headers");
     return -1;
+  }
+  src = readAt(e, e->segmentTable, ph, size);
+  if (src) {
+    if (src != ph)
+      LOADER_MEMCPY(ph, src, size);
+    ret = mapSegments(e, ph);
+  }
+  LOADER_FREE(ph);
+  return ret;
+}
 
-  e->entry = h.e_entry;
-  e->sections = h.e_shnum;
-  e->sectionTable = h.e_shoff;
-  e->sectionTableStrings = sH.sh_offset;
+/*
+ * Read headers and load modules that need no relocation. Returns 1 if
+ * nothing is left to do (compact and linked modules). On failure exec is
+ * released
+ */
+static int readHeaders(ELFExec_t *exec) {
+#ifdef LOADER_BLOCK_CACHE_BLOCKS
+  if (!exec->image && !IS_STREAM(exec))
+    initBlockCache(exec);
+#endif
+  if ((exec->image || LOADER_FD_VALID(exec->user_data)) && !IS_STREAM(exec)
+      && isCompact(exec)) {
+    if (loadCompact(exec) != 0) {
+      freeSymTable(exec);
+      freeElf(exec);
+      LOADER_FREE(exec);
+      return -2;
+    }
+    return 1;
+  }
+  if (initElf(exec) != 0) {
+#ifdef LOADER_METADATA_CACHE
+    freeMetadata(exec);
+#endif
+#ifdef LOADER_BLOCK_CACHE_BLOCKS
+    freeBlockCache(exec);
+#endif
+    /* The caller loses the descriptor along with exec */
+    if (!exec->image && !IS_STREAM(exec) && LOADER_FD_VALID(exec->user_data))
+      LOADER_CLOSE(exec->user_data);
+    LOADER_FREE(exec);
+    return -1;
+  }
+  if (exec->segments) {
+    if (loadSegments(exec) != 0) {
+      freeElf(exec);
+      LOADER_FREE(exec);
+      return -2;
+    }
+#ifdef LOADER_SYMBOL_INDEX
+    initSymIndex(exec);
+#endif
+    return 1;
+  }
+  return 0;
+}
 
+/*
+ * Place the sections of a relocatable module and load their data. On
+ * failure exec is released
+ */
+static int placeSections(ELFExec_t *exec) {
+  if (!IS_FLAGS_SET(loadSymbols(exec), FoundValid)) {
+    freeElf(exec);
+    LOADER_FREE(exec);
+    return -2;
+  }
+  initSymTable(exec);
   return 0;
 }
 
-static void freeElf(ELFExec_t *e) {
-  freeSection(&e->text);
-  freeSection(&e->rodata);
-  freeSection(&e->data);
-  freeSection(&e->bss);
-  freeSection(&e->sdram_rodata);
-  freeSection(&e->sdram_data);
-  freeSection(&e->sdram_bss);
-  freeSection(&e->init_array);
-  freeSection(&e->fini_array);
-  LOADER_CLOSE(e->user_data);
-}
-
-static int relocateSection(ELFExec_t *e, ELFSection_t *s, const char *name) {
-  DBG("Relocating section %s\n", name);
-  if (s->relSecIdx) {
-    Elf32_Shdr sectHdr;
-    if (readSecHeader(e, s->relSecIdx, &sectHdr) == 0)
-      return relocate(e, &sectHdr, s, name);
-    else {
-      ERR("Error reading section header");
-      return -1;
-    }
-  } else {
-    MSG("No relocation index"); /* Not an error */
+/*
+ * Read headers, place the module and load it up to relocation. Returns 1
+ * if nothing is left to do (compact and linked modules). On failure exec
+ * is released
+ */
+static int linkHeaders(ELFExec_t *exec) {
+  int ret = readHeaders(exec);
+  return ret != 0 ? ret : placeSections(exec);
+}
+
+/*
+ * Load and relocate module and build its symbol index. On failure exec is
+ * released
+ */
+static int linkElf(ELFExec_t *exec) {
+  int ret = linkHeaders(exec);
+  if (ret != 0)
+    return ret < 0 ? ret : 0;
+  if (relocateModule(exec) != 0) {
+    freeSymTable(exec);
+    freeElf(exec);
+    LOADER_FREE(exec);
+    return -3;
   }
+  freeSymTable(exec);
+#ifdef LOADER_SYMBOL_INDEX
+  initSymIndex(exec);
+#endif
   return 0;
 }
 
-static int relocateSections(ELFExec_t *e) {
-  return relocateSection(e, &e->text, ".text")
-      | relocateSection(e, &e->rodata, ".rodata")
-      | relocateSection(e, &e->data, ".data")
-      | relocateSection(e, &e->sdram_rodata, ".sdram_rodata")
-      | relocateSection(e, &e->sdram_data, ".sdram_data")
-      | relocateSection(e, &e->init_array, ".init_array")
-      | relocateSection(e, &e->fini_array, ".fini_array")
-      /* BSS not need relocation */
-#if 0
-      | relocateSection(e, &e->bss, ".bss")
+/*
+ * Run constructors of a linked module and release what loading needed
+ */
+static void startElf(ELFExec_t *exec) {
+  do_init(exec);
+#if defined(LOADER_METADATA_CACHE) && !defined(LOADER_METADATA_KEEP)
+  freeMetadata(exec);
+#endif
+#ifdef LOADER_BLOCK_CACHE_BLOCKS
+  freeBlockCache(exec);
+  DBG("Block cache: %u hits, %u misses\n", exec->cacheHits, exec->cacheMisses);
+#endif
+#if defined(LOADER_SYMBOL_INDEX) && defined(LOADER_CLOSE_AFTER_LOAD)
+  /* Exported symbols no longer need the file, lazy imports still do */
+  if (exec->symIndex && !exec->image
+#ifdef LOADER_LAZY_ENTRY
+      && !exec->lazy
+#endif
+      ) {
+    /* A stream belongs to the caller */
+    if (!IS_STREAM(exec))
+      LOADER_CLOSE(exec->user_data);
+    exec->fileClosed = 1;
+  }
 #endif
-  ;
 }
 
-int jumpTo(ELFExec_t *e) {
-  if (e->entry) {
-    entry_t *entry = (entry_t*) (e->text.data + e->entry);
-    LOADER_JUMP_TO(entry);
-    return 0;
-  } else {
-    MSG("No entry defined.");
-    return -1;
+static int loadElf(ELFExec_t *exec, ELFExec_t **exec_ptr) {
+  int ret = linkElf(exec);
+  if (ret != 0)
+    return ret;
+  startElf(exec);
+  *exec_ptr = exec;
+  return 0;
+}
+
+static ELFExec_t *newELFExec(LOADER_USERDATA_T user_data) {
+  ELFExec_t *exec;
+  exec = LOADER_ALIGN_ALLOC(sizeof(ELFExec_t), 4, ELF_SEC_READ | ELF_SEC_WRITE);
+  if (!exec) {
+    DBG("allocation failed\n\n");
+    return NULL;
   }
+  clearELFExec(exec);
+  exec->user_data = user_data;
+  return exec;
 }
 
-static void do_init(ELFExec_t *e) {
+int load_elf(const char *path, LOADER_USERDATA_T user_data, ELFExec_t **exec_ptr) {
+  int ret;
+  ELFExec_t *exec = newELFExec(user_data);
+  if (!exec)
+    return -1;
+  LOADER_OPEN_FOR_RD(exec->user_data, path);
+  ret = loadElf(exec, exec_ptr);
+  if (ret == -1)
+    DBG("Invalid elf %s\n", path);
+  return ret;
+}
 
-  if (e->init_array.data) {
-    MSG("Processing section .init_array.");
-    Elf32_Shdr sectHdr;
-    if (readSecHeader(e, e->init_array.secIdx, &sectHdr) != 0) {
-      ERR("Error reading section header");
-      return;
+#ifdef LOADER_STREAM
+int load_elf_stream(LOADER_USERDATA_T user_data, ELFExec_t **exec_ptr) {
+  int ret;
+  ELFExec_t *exec = newELFExec(user_data);
+  if (!exec)
+    return -1;
+  exec->stream = 1;
+  ret = loadElf(exec, exec_ptr);
+  if (ret == -1)
+    MSG("Invalid elf stream");
+  return ret;
+}
+#endif
+
+#ifdef LOADER_INCREMENTAL
+int load_begin(const char *path, LOADER_USERDATA_T user_data,
+    ELFExec_t **exec_ptr) {
+  ELFExec_t *exec = newELFExec(user_data);
+  if (!exec)
+    return -1;
+  exec->stepPhase = StepHeaders;
+  LOADER_OPEN_FOR_RD(exec->user_data, path);
+  *exec_ptr = exec;
+  return 0;
+}
+
+#ifdef LOADER_METADATA_CACHE
+/*
+ * Read one LOADER_STEP_BYTES chunk of the metadata: first the section
+ * header table, into a buffer of its own until it is laid out, then each
+ * range. stepSection is the range, stepPos the bytes of it read. Returns 1
+ * when done or on failure, which as in loadMetadata only drops the cache
+ */
+static int stepMetadata(ELFExec_t *e, unsigned int *budget) {
+  char *dst;
+  off_t off;
+  size_t size, n;
+  int i;
+  if (e->stepSection == MetaSecHdrs) {
+    size = e->sections * sizeof(Elf32_Shdr);
+    if (!e->meta)
+      e->meta = LOADER_ALIGN_ALLOC(size, 4, ELF_SEC_READ | ELF_SEC_WRITE);
+    if (!e->meta) {
+      MSG("No memory for metadata cache");
+      return 1;
     }
-    entry_t **entry = (entry_t**) (e->init_array.data);
-    int i;
-    int n = sectHdr.sh_size >> 2;
-    for(i=0;i<n;i++) {
-      DBG("Processing .init_array[%d] : %08x->%08x\n", i, (int)entry, (int)*entry);
-      (*entry)();
-      entry++;
+    if (e->stepPos == size) {
+      char *hdrs = e->meta;
+      e->meta = NULL;
+      i = layoutMetadata(e, (const Elf32_Shdr *) hdrs, e->stepShStrIdx);
+      LOADER_FREE(hdrs);
+      if (i != 0)
+        return 1;
+      e->stepSection++;
+      e->stepPos = 0;
+      return 0;
     }
+    off = e->sectionTable;
+    dst = e->meta;
   } else {
-    MSG("No .init_array"); // and that's fine
+    const ELFMetaRange_t *r = &e->metaRange[e->stepSection];
+    /* A string table shared with an earlier range is read once */
+    for (i = MetaSecHdrs + 1; i < e->stepSection; i++)
+      if (e->metaRange[i].data == r->data && e->metaRange[i].size == r->size)
+        break;
+    size = i < e->stepSection ? 0 : r->size;
+    if (e->stepPos == size) {
+      e->stepPos = 0;
+      return ++e->stepSection == MetaRanges;
+    }
+    off = r->offset;
+    dst = (char *) r->data;
+  }
+  n = size - e->stepPos;
+  if (n > LOADER_STEP_BYTES)
+    n = LOADER_STEP_BYTES;
+  if (!fileRead(e, off + e->stepPos, dst + e->stepPos, n)) {
+    MSG("Metadata cache read fail");
+    freeMetadata(e);
+    return 1;
   }
+  e->stepPos += n;
+  (*budget)--;
+  return 0;
 }
+#endif
 
-static void do_fini(ELFExec_t *e) {
-  if (e->fini_array.data) {
-    entry_t **entry = (entry_t**) (e->fini_array.data);
-    int i;
-    int n = e->fini_array_size >> 2;
-    for(i=0;i<n;i++) {
-      DBG("Processing .fini_array[%d] : %08x->%08x\n", i, (int)entry, (int)*entry);
-      (*entry)();
-      entry++;
+/*
+ * Next section with data to load or relocations to apply, from stepSection
+ */
+static int nextStepSection(ELFExec_t *e) {
+  while (e->stepSection < e->sections) {
+    ELFSection_t *s = &e->section[e->stepSection];
+    if (s->data && (e->stepPhase == StepData || s->relSecIdx))
+      return 1;
+    e->stepSection++;
+  }
+  return 0;
+}
+
+/*
+ * Load or relocate the current section, up to *budget units
+ */
+static int stepSectionChunk(ELFExec_t *e, unsigned int *budget) {
+  ELFSection_t *s = &e->section[e->stepSection];
+  Elf32_Shdr hdrBuf;
+  const Elf32_Shdr *h;
+  size_t size, count;
+  h = readSecHeader(e, e->stepPhase == StepData ? e->stepSection
+      : s->relSecIdx, &hdrBuf);
+  if (!h)
+    return -1;
+  if (e->stepPhase == StepData) {
+    size = h->sh_size - e->stepPos;
+    count = (size + LOADER_STEP_BYTES - 1) / LOADER_STEP_BYTES;
+    if (count > *budget) {
+      count = *budget;
+      size = count * LOADER_STEP_BYTES;
     }
+    if (loadSecRange(e, s, h, e->stepPos, size) != 0)
+      return -1;
+    e->stepPos += size;
   } else {
-    MSG("No .fini_array"); // and that's fine too
+    size = h->sh_size / REL_SIZE(h);
+    count = size - e->stepPos;
+    if (count > *budget)
+      count = *budget;
+    if (relocateRange(e, h, s, e->stepPos, e->stepPos + count) != 0)
+      return -1;
+    e->stepPos += count;
   }
+  *budget -= count;
+  if (e->stepPos == (e->stepPhase == StepData ? h->sh_size : size)) {
+    e->stepSection++;
+    e->stepPos = 0;
+  }
+  return 0;
 }
 
-void* get_sym(ELFExec_t *exec, const char *sym_name, int symbol_type) {
-  off_t old = LOADER_TELL(exec->user_data);
-  off_t pos = exec->symbolTable;
-  if (LOADER_SEEK_FROM_START(exec->user_data, pos) != 0) {
-    MSG("seek err");
-    return 0;
-  }
-  int i;
-  entry_t *addr = 0;
-  for (i = 0; i < exec->symbolCount; i++) {
-    Elf32_Sym sym;
-    if (LOADER_READ(exec->user_data, &sym, sizeof(Elf32_Sym)) == sizeof(Elf32_Sym)) {
-      if (sym.st_name && (ELF32_ST_TYPE(sym.st_info) == symbol_type)) {
-        char name[LOADER_MAX_SYM_LENGTH] = "<unnamed>";
-        int ret = readSymbolName(exec, sym.st_name, name, sizeof(name));
-        if (!ret) {
-          DBG("readSymbolName failed");
-        } else {
-          //DBG("sym %d = \"%s\" @ %08x, st_shndx = %d\n",i,name,sym.st_value, sym.st_shndx);
-          if (LOADER_STREQ(name, sym_name)) {
-            ELFSection_t *symSec = sectionOf(exec, sym.st_shndx);
-            if (symSec) {
-              addr = (entry_t*) (((Elf32_Addr) symSec->data) + sym.st_value);
-              DBG("sym \"%s\" found @ %08x\n", name, addr);
-              break;
-            } else if (symbol_type == STT_NOTYPE) {
-              addr = sym.st_value;
-              DBG("sym \"%s\" found @ %08x\n", name, addr);
-              break;
-            }
-          }
+int load_step(ELFExec_t *exec, unsigned int budget) {
+  int ret;
+  while (budget && exec->stepPhase != StepDone) {
+    switch (exec->stepPhase) {
+    case StepHeaders:
+      ret = readHeaders(exec);
+      if (ret < 0)
+        return ret;
+      exec->stepPhase = ret > 0 ? StepDone : StepMetadata;
+      exec->stepSection = 0;
+      exec->stepPos = 0;
+      budget--;
+      break;
+    case StepMetadata:
+#ifdef LOADER_METADATA_CACHE
+      if (!exec->image && exec->sections
+          && stepMetadata(exec, &budget) == 0)
+        break;
+#endif
+      exec->stepPhase = StepPlace;
+      break;
+    case StepPlace:
+      ret = placeSections(exec);
+      if (ret < 0)
+        return ret;
+      if (loadImports(exec) != 0) {
+        ret = -3;
+        goto fail;
+      }
+      exec->stepPhase = StepData;
+      exec->stepSection = 1;
+      exec->stepPos = 0;
+      budget--;
+      break;
+    case StepData:
+    case StepRelocate:
+      if (nextStepSection(exec)) {
+        if (stepSectionChunk(exec, &budget) != 0) {
+          ret = exec->stepPhase == StepData ? -2 : -3;
+          goto fail;
         }
+      } else if (exec->stepPhase == StepData) {
+        exec->stepPhase = StepRelocate;
+        exec->stepSection = 1;
+      } else {
+        freeSymTable(exec);
+        exec->stepPhase = StepIndex;
       }
+      break;
+    case StepIndex:
+#ifdef LOADER_SYMBOL_INDEX
+      initSymIndex(exec);
+#endif
+      exec->stepPhase = StepDone;
+      budget--;
+      break;
+    default:
+      return -1;
     }
   }
-  (void) LOADER_SEEK_FROM_START(exec->user_data, old);
-  if (!addr) {
-    DBG("sym \"%s\" not found\n", sym_name);
+  return exec->stepPhase != StepDone;
+
+fail:
+  freeSymTable(exec);
+  freeElf(exec);
+  LOADER_FREE(exec);
+  return ret;
+}
+
+int load_finish(ELFExec_t *exec) {
+  if (exec->stepPhase != StepDone)
+    return -1;
+  startElf(exec);
+  return 0;
+}
+#endif
+
+static int loadImage(const void *image, size_t size,
+    LOADER_USERDATA_T user_data, ELFExec_t **exec_ptr, int xip) {
+  int ret;
+  ELFExec_t *exec;
+  if (((uintptr_t) image) & 3) {
+    MSG("Image not word aligned");
+    return -1;
   }
-  return addr;
+  exec = newELFExec(user_data);
+  if (!exec)
+    return -1;
+  exec->image = image;
+  exec->imageSize = size;
+  exec->xip = xip;
+  ret = loadElf(exec, exec_ptr);
+  if (ret == -1)
+    DBG("Invalid elf image @ %08x\n", (unsigned int) image);
+  return ret;
 }
 
-void* get_obj(ELFExec_t *exec, const char *obj_name) {
-  return get_sym(exec, obj_name, STT_OBJECT);
+int load_elf_from_buffer(const void *image, size_t size,
+    LOADER_USERDATA_T user_data, ELFExec_t **exec_ptr) {
+  return loadImage(image, size, user_data, exec_ptr, 0);
 }
 
-void* get_func(ELFExec_t *exec, const char *func_name) {
-  return get_sym(exec, func_name, STT_FUNC);
+int load_elf_xip(const void *image, size_t size,
+    LOADER_USERDATA_T user_data, ELFExec_t **exec_ptr) {
+  return loadImage(image, size, user_data, exec_ptr, 1);
 }
 
-static void clearELFExec(ELFExec_t *e) {
-  char *c = (char *)e;
-  int i;
-  for(i=0;i<sizeof(ELFExec_t);i++){
-    *c++=0;
+#ifdef LOADER_FLASH_WRITE
+static int flashWrite(ELFExec_t *e, Elf32_Word off, const void *src,
+    size_t size) {
+  if (size && LOADER_FLASH_WRITE(&e->user_data, e->install->flash + off, src,
+      size) != 0) {
+    ERR("Flash write failed");
+    return -1;
   }
+  return 0;
 }
 
-int load_elf(const char *path, LOADER_USERDATA_T user_data, ELFExec_t **exec_ptr) {
-  ELFExec_t *exec;
-  exec = LOADER_ALIGN_ALLOC(sizeof(ELFExec_t), 4, ELF_SEC_READ | ELF_SEC_WRITE);
-  if (!exec) {
-    DBG("allocation failed\n\n");
+/*
+ * Program the installed image. The header goes last, so an interrupted
+ * install leaves no valid image behind
+ */
+static int writeInstall(ELFExec_t *e) {
+  ELFInstallHeader_t *ih = &e->installHeader;
+  size_t indexSize = e->symIndexSize * sizeof(ELFSymIndexSlot_t)
+      + e->symIndexNames;
+  int n;
+  ih->magic = ELF_INSTALL_MAGIC;
+  ih->buildId = LOADER_BUILD_ID(&e->user_data);
+  ih->sections = e->sections;
+  ih->textIdx = e->textIdx;
+  ih->entry = e->entry;
+  ih->data = (ih->code + ih->codeSize + 3) & ~3;
+  ih->symIndex = (ih->data + ih->dataSize + 3) & ~3;
+  ih->symIndexSize = e->symIndex ? e->symIndexSize : 0;
+  ih->size = ih->symIndex + (e->symIndex ? indexSize : 0);
+  if (ih->size > e->install->flash_size) {
+    ERR("Installed image does not fit");
     return -1;
   }
-  clearELFExec(exec);
-  exec->user_data = user_data;
+  for (n = 0; n < e->sections; n++) {
+    ELFInstallSection_t sec;
+    sec.addr = e->section[n].data ? e->section[n].addr : 0;
+    sec.size = e->section[n].size;
+    sec.kind = e->section[n].kind;
+    if (flashWrite(e, sizeof(ELFInstallHeader_t) + n * sizeof(sec), &sec,
+        sizeof(sec)) != 0)
+      return -1;
+  }
+  if (flashWrite(e, ih->code, e->region[InstallFlash], ih->codeSize) != 0
+      || flashWrite(e, ih->data, e->install->ram, ih->dataSize) != 0
+      || (e->symIndex && flashWrite(e, ih->symIndex, e->symIndex,
+          indexSize) != 0))
+    return -1;
+  DBG("Installed %d bytes @ %08x\n", ih->size, e->install->flash);
+  return flashWrite(e, 0, ih, sizeof(ELFInstallHeader_t));
+}
+
+int install_elf(const char *path, LOADER_USERDATA_T user_data,
+    const ELFInstall_t *target) {
+  int ret;
+  ELFExec_t *exec = newELFExec(user_data);
+  if (!exec)
+    return -1;
+  exec->install = target;
+  exec->placement = &installPlacement;
   LOADER_OPEN_FOR_RD(exec->user_data, path);
-  if (initElf(exec) != 0) {
-    DBG("Invalid elf %s\n", path);
+  ret = linkElf(exec);
+  if (ret != 0) {
+    DBG("Can't install %s\n", path);
+    return ret;
+  }
+  if (writeInstall(exec) != 0)
+    ret = -4;
+  freeElf(exec);
+  LOADER_FREE(exec);
+  return ret;
+}
+
+/*
+ * Whether len bytes at off lie within size bytes
+ */
+static int inRange(Elf32_Word off, Elf32_Word len, size_t size) {
+  return off <= size && len <= size - off;
+}
+
+/*
+ * Whether section i of an installed image lies in the flash code or in the
+ * RAM block
+ */
+static int installedSecValid(const ELFInstallHeader_t *ih,
+    const ELFInstall_t *t, const ELFInstallSection_t *sec) {
+  Elf32_Addr flash = t->flash + ih->code;
+  if (!sec->addr)
+    return 1;
+  if (sec->addr >= flash && inRange(sec->addr - flash, sec->size,
+      ih->codeSize))
+    return 1;
+  return sec->addr >= ih->ram && inRange(sec->addr - ih->ram, sec->size,
+      ih->bssStart + ih->bssSize);
+}
+
+/*
+ * Check every offset and count of an installed image against the image and
+ * the RAM block before boot uses them, so a corrupt slot is rejected
+ * instead of read or copied out of bounds
+ */
+static int installValid(const ELFInstallHeader_t *ih, const ELFInstall_t *t) {
+  const ELFInstallSection_t *sec = (const ELFInstallSection_t *) (ih + 1);
+  const char *image = (const char *) ih;
+  size_t names;
+  Elf32_Word i;
+  if (ih->size < sizeof(ELFInstallHeader_t) || ih->size > t->flash_size
+      || !ih->sections
+      || ih->sections > (ih->size - sizeof(ELFInstallHeader_t))
+          / sizeof(ELFInstallSection_t)
+      || ih->textIdx >= ih->sections
+      || (ih->entry && ih->entry >= sec[ih->textIdx].size)
+      || !inRange(ih->code, ih->codeSize, ih->size)
+      || !inRange(ih->data, ih->dataSize, ih->size)
+      || ih->dataSize > ih->bssStart
+      || !inRange(ih->bssStart, ih->bssSize, t->ram_size)
+      || !inRange(ih->symIndex, 0, ih->size)
+      || ih->symIndexSize > (ih->size - ih->symIndex)
+          / sizeof(ELFSymIndexSlot_t)
+      || (ih->symIndexSize & (ih->symIndexSize - 1)))
+    return 0;
+  for (i = 0; i < ih->sections; i++)
+    if (!installedSecValid(ih, t, &sec[i]))
+      return 0;
+  if (ih->symIndexSize) {
+    const ELFSymIndexSlot_t *slots;
+    slots = (const ELFSymIndexSlot_t *) (image + ih->symIndex);
+    /* Names follow the slots up to the end of the image */
+    names = ih->size - ih->symIndex
+        - ih->symIndexSize * sizeof(ELFSymIndexSlot_t);
+    if (!names || image[ih->size - 1])
+      return 0;
+    for (i = 0; i < ih->symIndexSize; i++)
+      if (slots[i].name >= names)
+        return 0;
+  }
+  return 1;
+}
+
+int boot_elf(const ELFInstall_t *target, LOADER_USERDATA_T user_data,
+    ELFExec_t **exec_ptr) {
+  const ELFInstallHeader_t *ih = (const ELFInstallHeader_t *) target->flash;
+  const ELFInstallSection_t *sec = (const ELFInstallSection_t *) (ih + 1);
+  ELFExec_t *exec;
+  Elf32_Word i;
+  if (ih->magic != ELF_INSTALL_MAGIC
+      || ih->buildId != LOADER_BUILD_ID(&user_data)
+      || ih->ram != (Elf32_Addr) target->ram) {
+    MSG("No installed image for this build");
     return -1;
   }
-  if (!IS_FLAGS_SET(loadSymbols(exec), FoundValid)) {
-    freeElf(exec);
-    LOADER_FREE(exec);
-    return -2;
+  if (!installValid(ih, target)) {
+    MSG("Installed image is corrupt");
+    return -1;
   }
-  if (relocateSections(exec) != 0) {
-    freeElf(exec);
+  exec = newELFExec(user_data);
+  if (!exec)
+    return -1;
+  exec->image = (const char *) ih;
+  exec->imageSize = ih->size;
+  exec->installed = 1;
+  exec->sections = ih->sections;
+  exec->textIdx = ih->textIdx;
+  exec->entry = ih->entry;
+  exec->placement = &defaultPlacement;
+  if (allocSectionTable(exec) != 0) {
     LOADER_FREE(exec);
-    return -3;
+    return -1;
+  }
+  for (i = 0; i < ih->sections; i++) {
+    exec->section[i].data = (void *) sec[i].addr;
+    exec->section[i].addr = sec[i].addr;
+    exec->section[i].size = sec[i].size;
+    exec->section[i].kind = sec[i].kind;
   }
+  LOADER_MEMCPY(target->ram, exec->image + ih->data, ih->dataSize);
+  LOADER_CLEAR((char *) target->ram + ih->bssStart, ih->bssSize);
+  if (ih->symIndexSize) {
+    exec->symIndex = (ELFSymIndexSlot_t *) (exec->image + ih->symIndex);
+    exec->symIndexSize = ih->symIndexSize;
+  }
+  exec->fileClosed = 1;
   do_init(exec);
   *exec_ptr = exec;
   return 0;
 }
+#endif
 
 int unload_elf(ELFExec_t *exec) {
   do_fini(exec);
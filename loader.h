@@ -32,6 +32,8 @@
 #ifndef LOADER_H_
 #define LOADER_H_
 
+#include <stddef.h>
+#include <stdint.h>
 #include "loader_userdata.h"
 
 #ifdef __cplusplus__
@@ -54,8 +56,75 @@ typedef enum {
 
 typedef void (entry_t)(void);
 
+/**
+ * Memory region for module sections
+ */
+typedef struct {
+  const char *name; /*!< Region name, as in the linker script memory map */
+  void *(*alloc)(size_t size, size_t align, ELFSecPerm_t perm); /*!< Allocator */
+  void (*free)(void *ptr); /*!< Release function, NULL to use LOADER_FREE */
+  int fallback; /*!< Region used if alloc fails, -1 for none */
+} ELFRegion_t;
+
+/**
+ * Section placement rule
+ */
+typedef struct {
+  const char *prefix; /*!< Section name prefix, NULL matches any name */
+  unsigned int flags; /*!< ELF_SEC_* flags the section must have */
+  size_t min_size; /*!< Minimum section size */
+  int region; /*!< Index on ELFPlacement_t::regions */
+} ELFPlacementRule_t;
+
+/**
+ * Section placement map
+ *
+ * Each allocated section goes to the region of the first matching rule,
+ * or to region 0 if no rule matches. All sections of a region share one
+ * allocation; if it fails they move to the fallback region
+ */
+typedef struct {
+  const ELFRegion_t *regions; /*!< Memory regions */
+  unsigned int regions_size; /*!< Elements on regions array */
+  const ELFPlacementRule_t *rules; /*!< Rules, in priority order */
+  unsigned int rules_size; /*!< Elements on rules array */
+} ELFPlacement_t;
+
 typedef struct ELFExec ELFExec_t;
 
+/**
+ * Name of a symbol of the module being loaded
+ *
+ * Names are not copied to a buffer: they are read piecewise from the module
+ * by #elf_name_eq, #elf_name_eq_at and #elf_name_hash_stream, so they have
+ * no length limit and compares stop at the first differing byte
+ */
+typedef struct {
+  ELFExec_t *exec; /*!< Module */
+  uint32_t offset; /*!< Offset of name on module */
+} ELFName_t;
+
+/**
+ * Install target of a module
+ *
+ * Code and constants of an installed module run from flash at a fixed
+ * address; its writable data lives in a RAM block reserved for it
+ */
+typedef struct {
+  uintptr_t flash; /*!< Address of the image in flash (memory mapped) */
+  size_t flash_size; /*!< Bytes available at flash */
+  void *ram; /*!< RAM block for .data, .bss and init/fini arrays */
+  size_t ram_size; /*!< Size of the RAM block */
+} ELFInstall_t;
+
+/**
+ * Block cache statistics
+ */
+typedef struct {
+  unsigned int hits; /*!< Reads served from cached blocks */
+  unsigned int misses; /*!< Blocks read from storage */
+} ELFCacheStats_t;
+
 /**
  * Load ELF file from "path" with environment "env"
  * @param path Path to file to load
@@ -66,6 +135,135 @@ typedef struct ELFExec ELFExec_t;
  */
 extern int load_elf(const char *path, LOADER_USERDATA_T user_data, ELFExec_t **exec);
 
+/**
+ * Load ELF image already present in memory
+ *
+ * Headers, symbols and strings are accessed in place, without seek/read
+ * calls. Useful for modules received in RAM or memory mapped flash.
+ *
+ * @param image Pointer to ELF image (word aligned)
+ * @param size Size of image in bytes
+ * @param user_data Pointer to user data
+ * @param exec returns pointer to ELFExec_t struct
+ * @retval 0 On successful
+ * @todo Error information
+ */
+extern int load_elf_from_buffer(const void *image, size_t size,
+    LOADER_USERDATA_T user_data, ELFExec_t **exec);
+
+/**
+ * Load ELF image executing in place
+ *
+ * Like #load_elf_from_buffer, but read-only sections without relocations
+ * (code and constants of modules relocated at install time, or that need
+ * none) are used from the image instead of being copied to RAM. Only
+ * writable data, .bss, init/fini arrays and relocated sections take RAM.
+ * The image must stay mapped (memory mapped flash) until #unload_elf
+ *
+ * @param image Pointer to ELF image (word aligned)
+ * @param size Size of image in bytes
+ * @param user_data Pointer to user data
+ * @param exec returns pointer to ELFExec_t struct
+ * @retval 0 On successful
+ * @todo Error information
+ */
+extern int load_elf_xip(const void *image, size_t size,
+    LOADER_USERDATA_T user_data, ELFExec_t **exec);
+
+/**
+ * Load ELF from a stream that can't seek (serial link, USB, pipe)
+ *
+ * The stream, already open in user_data, is read once front to back with
+ * #LOADER_READ and is not closed. Only section headers, names and the
+ * symbol table are buffered: section data is read to its final address and
+ * relocated there. The module must be laid out for it by
+ * tools/mkstream.py. Needs #LOADER_STREAM
+ *
+ * @param user_data Pointer to user data, with the stream open
+ * @param exec returns pointer to ELFExec_t struct
+ * @retval 0 On successful
+ * @todo Error information
+ */
+extern int load_elf_stream(LOADER_USERDATA_T user_data, ELFExec_t **exec);
+
+/**
+ * Start an incremental load of ELF file from "path"
+ *
+ * Only opens the file: the module is loaded by calls to #load_step and
+ * started by #load_finish, so a load can run in the idle time of a task
+ * that must not block. Needs #LOADER_INCREMENTAL
+ *
+ * @param path Path to file to load
+ * @param user_data Pointer to user data
+ * @param exec returns pointer to ELFExec_t struct of the load
+ * @retval 0 On successful
+ * @todo Error information
+ */
+extern int load_begin(const char *path, LOADER_USERDATA_T user_data,
+    ELFExec_t **exec);
+
+/**
+ * Advance an incremental load by at most "budget" units of work
+ *
+ * A unit is one relocation, #LOADER_STEP_BYTES bytes of metadata or
+ * section data read or cleared, or one of the steps that are not split:
+ * reading the ELF header (the first call), placing and allocating the
+ * sections, and building the symbol index. Compact and linked modules load
+ * whole in the first call, whatever the budget
+ *
+ * @param exec Load started by #load_begin
+ * @param budget Units of work to do in this call
+ * @retval 1 More work left
+ * @retval 0 Module ready for #load_finish
+ * @retval <0 Load failed, exec is released (same codes as #load_elf)
+ */
+extern int load_step(ELFExec_t *exec, unsigned int budget);
+
+/**
+ * Run constructors of a module loaded with #load_step
+ *
+ * After this the module is used like one loaded by #load_elf
+ *
+ * @param exec Load whose #load_step returned 0
+ * @retval 0 On successful
+ */
+extern int load_finish(ELFExec_t *exec);
+
+/**
+ * Install ELF file to flash
+ *
+ * The module is linked once for the target addresses and programmed with
+ * #LOADER_FLASH_WRITE, along with a header holding the #LOADER_BUILD_ID
+ * of the host. The RAM block of the target is overwritten. No
+ * constructors run. Needs #LOADER_FLASH_WRITE and #LOADER_SYMBOL_INDEX
+ *
+ * @param path Path to file to install
+ * @param user_data Pointer to user data
+ * @param target Flash address and RAM block of the module
+ * @retval 0 On successful
+ * @todo Error information
+ */
+extern int install_elf(const char *path, LOADER_USERDATA_T user_data,
+    const ELFInstall_t *target);
+
+/**
+ * Start module installed by #install_elf
+ *
+ * No file access and no relocation: checks the image header, copies the
+ * initial data to the RAM block, clears .bss and runs the constructors.
+ * Fails if there is no image at target, it was installed by another host
+ * build or any of its offsets falls outside the image or the RAM block,
+ * then the module must be installed again
+ *
+ * @param target Same target used to install the module
+ * @param user_data Pointer to user data
+ * @param exec returns pointer to ELFExec_t struct
+ * @retval 0 On successful
+ * @todo Error information
+ */
+extern int boot_elf(const ELFInstall_t *target, LOADER_USERDATA_T user_data,
+    ELFExec_t **exec);
+
 /**
  * Unload ELF
  * @param exec Pointer to ELFExec_t struct
@@ -109,6 +307,95 @@ extern void * get_obj(ELFExec_t *exec, const char *obj_name);
  */
 extern void * get_sym(ELFExec_t *exec, const char *sym_name, int symbol_type);
 
+/**
+ * Get PIC base of a linked module built with a GOT
+ *
+ * Value loaded to the PIC base register (r9) before module code runs, see
+ * LOADER_CALL_PIC. Host code calling module functions directly has to set
+ * it too
+ * @param exec Pointer to ELFExec_t struct
+ * @retval GOT run time address, 0 if the module has none
+ */
+extern void *get_pic_base(ELFExec_t *exec);
+
+/**
+ * Bind a lazy import
+ *
+ * Called by the LOADER_LAZY_ENTRY code the first time a module calls an
+ * import bound lazily. Resolves it through LOADER_GETUNDEFSYMADDR and
+ * patches the stub, so later calls go straight to the import. Reads the
+ * module symbol table, so it must not run while the same module is being
+ * read by the loader.
+ *
+ * On NULL the import can't be resolved and the calling module can't go
+ * on: LOADER_LAZY_ENTRY must not branch to the result then, but report
+ * the error and stop (the sample host traps in arch_lazyFail)
+ * @param ip Value of IP (r12) on entry to LOADER_LAZY_ENTRY
+ * @retval Import address to tail call, NULL if it can't be resolved
+ */
+extern void *elf_lazy_bind(void *ip);
+
+
+/**
+ * Get block cache statistics of last load
+ * @param exec Pointer to ELFExec_t struct
+ * @param stats returns hit/miss counters
+ * @retval 0 On successful, -1 if block cache is not enabled
+ */
+extern int get_cache_stats(ELFExec_t *exec, ELFCacheStats_t *stats);
+
+/**
+ * Hash of symbol name
+ *
+ * Stable 32 bit hash (FNV-1a plus final mix) used by symbol indexes. Host
+ * tools generating tables must use the same function (see
+ * tools/mkexports.py)
+ * @param name Zero terminated symbol name
+ * @retval hash value
+ */
+extern uint32_t elf_name_hash(const char *name);
+
+/**
+ * Seeded hash of symbol name
+ *
+ * Same as #elf_name_hash with a different start value. Used by the
+ * displacement step of generated perfect hash tables
+ * @param name Zero terminated symbol name
+ * @param seed Seed value, elf_name_hash_seed(name, 0) == elf_name_hash(name)
+ * @retval hash value
+ */
+extern uint32_t elf_name_hash_seed(const char *name, uint32_t seed);
+
+/**
+ * Seeded hash of module symbol name
+ *
+ * Same value as #elf_name_hash_seed of the name, computed while it is read
+ * @param name Module symbol name
+ * @param seed Seed value
+ * @param len If not NULL, returns length of name
+ * @retval hash value
+ */
+extern uint32_t elf_name_hash_stream(const ELFName_t *name, uint32_t seed,
+    size_t *len);
+
+/**
+ * Compare module symbol name
+ * @param name Module symbol name
+ * @param str Zero terminated string
+ * @retval 1 if equal, 0 otherwise
+ */
+extern int elf_name_eq(const ELFName_t *name, const char *str);
+
+/**
+ * Compare part of module symbol name
+ * @param name Module symbol name
+ * @param pos Position on name
+ * @param str Characters to compare (not zero terminated)
+ * @param len Number of characters to compare
+ * @retval 1 if len characters of name starting at pos are equal to str
+ */
+extern int elf_name_eq_at(const ELFName_t *name, size_t pos, const char *str,
+    size_t len);
 
 /** @} */
 
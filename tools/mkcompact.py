@@ -0,0 +1,494 @@
+#!/usr/bin/env python3
+#
+# ARMv7M ELF loader
+# Copyright (c) 2013-2015 Martin Ribelotta
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted under the terms of the BSD 3-clause license,
+# see LICENSE file.
+#
+"""Convert a relocatable module to the compact load format.
+
+The loader parses ET_REL modules on the device: section headers by name,
+symbols through string tables, generic Elf32_Rel records. This tool does
+that work once on the build host and writes a file the loader reads
+front to back:
+
+    header
+    segment descriptors     one per host memory region ("sram", "sdram" or
+                            the regions named in .elfloader.placement)
+    init/fini arrays        (segment, offset, size)
+    imports                 host ABI ordinal or offset of name in the pool
+    names pool              region and import names
+    segment data            pre-laid-out, .bss last and not stored
+    relocation streams      one per segment, sorted by offset
+    export index            ready to use hash table of functions/objects
+
+References between sections of the same segment are resolved here; the
+rest are relative to a segment base or to an import. The loader accepts
+the result through load_elf() and load_elf_from_buffer().
+
+Relocation records are little endian words:
+
+    bits 0-7    R_ARM_* type, 0 for a control record
+    bits 8-19   target: segment index, or segment count + import index
+    bits 20-31  distance to the previous record of the stream, halfwords
+
+A control record with target 0 only skips distance, with target 0xfff
+gives in the next word the addend of the following relocation (when its
+field can't hold it), with other targets n it repeats the previous
+relocation n times, distance apart.
+"""
+
+import argparse
+import struct
+import sys
+
+from mkexports import name_hash
+from mkimports import Elf32, read_abi, SHT_NOBITS, SHT_SYMTAB
+
+COMPACT_MAGIC = 0x58464c45  # "ELFX"
+IMPORTS_MAGIC = 0x49464c45  # "ELFI"
+PLACEMENT_MAGIC = 0x50464c45  # "ELFP"
+IMPORT_ORDINAL = 0x80000000
+SHT_RELA = 4
+SHT_REL = 9
+SHT_INIT_ARRAY = 14
+SHT_FINI_ARRAY = 15
+SHF_WRITE = 1
+SHF_ALLOC = 2
+SHF_EXECINSTR = 4
+STT_OBJECT = 1
+STT_FUNC = 2
+STB_LOCAL = 0
+STB_GLOBAL = 1
+STB_WEAK = 2
+REL_ADDEND = 0xfff
+ARRAY_INIT = 1  # ELFSecKind_t
+ARRAY_FINI = 2
+
+
+def log2(n):
+    return max(n, 1).bit_length() - 1
+
+
+# R_ARM_* type: field patched, result relative to P ('p'), to P & ~3 ('pa')
+# or absolute (None). Must match relHowto in loader.c
+RELOCS = {
+    0: ('none', None),  # R_ARM_NONE
+    2: ('word', None),  # R_ARM_ABS32
+    3: ('word', 'p'),  # R_ARM_REL32
+    5: ('half', None),  # R_ARM_ABS16
+    8: ('byte', None),  # R_ARM_ABS8
+    10: ('call', 'p'),  # R_ARM_THM_CALL
+    11: ('pc8', 'pa'),  # R_ARM_THM_PC8
+    30: ('call', 'p'),  # R_ARM_THM_JUMP24
+    38: ('word', None),  # R_ARM_TARGET1
+    40: ('none', None),  # R_ARM_V4BX
+    42: ('prel31', 'p'),  # R_ARM_PREL31
+    47: ('movw', None),  # R_ARM_THM_MOVW_ABS_NC
+    48: ('movt', None),  # R_ARM_THM_MOVT_ABS
+    49: ('movw', 'p'),  # R_ARM_THM_MOVW_PREL_NC
+    50: ('movt', 'p'),  # R_ARM_THM_MOVT_PREL
+    51: ('jump19', 'p'),  # R_ARM_THM_JUMP19
+    54: ('pc12', 'pa'),  # R_ARM_THM_PC12
+    102: ('jump11', 'p'),  # R_ARM_THM_JUMP11
+    103: ('jump8', 'p'),  # R_ARM_THM_JUMP8
+}
+BRANCH_BITS = {'call': 25, 'jump19': 21, 'jump11': 12, 'jump8': 9}
+
+
+def sext(v, bits):
+    v &= (1 << bits) - 1
+    return v - (1 << bits) if v >> (bits - 1) else v
+
+
+def get_addend(field, data, p):
+    """Addend of a REL entry, stored in its field"""
+    if field in ('word', 'prel31'):
+        v, = struct.unpack_from('<I', data, p)
+        return sext(v, 32 if field == 'word' else 31)
+    if field == 'half':
+        return struct.unpack_from('<h', data, p)[0]
+    if field == 'byte':
+        return struct.unpack_from('<b', data, p)[0]
+    h0, = struct.unpack_from('<H', data, p)
+    h1 = struct.unpack_from('<H', data, p + 2)[0] if len(data) >= p + 4 else 0
+    if field == 'call':
+        s = (h0 >> 10) & 1
+        i1 = ~((h1 >> 13) ^ s) & 1
+        i2 = ~((h1 >> 11) ^ s) & 1
+        return sext((s << 24) | (i1 << 23) | (i2 << 22)
+                    | ((h0 & 0x3ff) << 12) | ((h1 & 0x7ff) << 1), 25)
+    if field == 'jump19':
+        return sext((((h0 >> 10) & 1) << 20) | (((h1 >> 11) & 1) << 19)
+                    | (((h1 >> 13) & 1) << 18) | ((h0 & 0x3f) << 12)
+                    | ((h1 & 0x7ff) << 1), 21)
+    if field == 'jump11':
+        return sext((h0 & 0x7ff) << 1, 12)
+    if field == 'jump8':
+        return sext((h0 & 0xff) << 1, 9)
+    if field in ('movw', 'movt'):
+        return sext(((h0 & 0xf) << 12) | ((h0 & 0x400) << 1)
+                    | ((h1 & 0x7000) >> 4) | (h1 & 0xff), 16)
+    if field == 'pc8':
+        return ((((h0 & 0xff) << 2) + 4) & 0x3ff) - 4
+    if field == 'pc12':
+        return h1 & 0xfff if h0 & 0x80 else -(h1 & 0xfff)
+    return 0
+
+
+def put_field(field, data, p, v, addend=False):
+    """Write a result, or with addend a REL addend, to a field. False if it
+    doesn't fit"""
+    if field == 'word':
+        struct.pack_into('<I', data, p, v & 0xffffffff)
+    elif field == 'prel31':
+        if not -(1 << 30) <= v < 1 << 30:
+            return False
+        w, = struct.unpack_from('<I', data, p)
+        struct.pack_into('<I', data, p, (w & 0x80000000) | (v & 0x7fffffff))
+    elif field in ('half', 'byte'):
+        bits = 16 if field == 'half' else 8
+        if not -(1 << bits - 1) <= v < (1 << (bits - (1 if addend else 0))):
+            return False
+        struct.pack_into('<H' if bits == 16 else '<B', data, p,
+                         v & ((1 << bits) - 1))
+    elif field in BRANCH_BITS:
+        bits = BRANCH_BITS[field]
+        if not -(1 << bits - 1) <= v < 1 << bits - 1 or (addend and v & 1):
+            return False
+        h0, h1 = struct.unpack_from('<HH', data + b'\0\0', p)
+        if field == 'call':
+            s = (v >> 24) & 1
+            h0 = (h0 & 0xf800) | (s << 10) | ((v >> 12) & 0x3ff)
+            h1 = ((h1 & 0xd000) | ((s ^ (~(v >> 23) & 1)) << 13)
+                  | ((s ^ (~(v >> 22) & 1)) << 11) | ((v >> 1) & 0x7ff))
+        elif field == 'jump19':
+            h0 = (h0 & 0xfbc0) | (((v >> 20) & 1) << 10) | ((v >> 12) & 0x3f)
+            h1 = ((h1 & 0xd000) | (((v >> 18) & 1) << 13)
+                  | (((v >> 19) & 1) << 11) | ((v >> 1) & 0x7ff))
+        elif field == 'jump11':
+            h0 = (h0 & 0xf800) | ((v >> 1) & 0x7ff)
+        else:
+            h0 = (h0 & 0xff00) | ((v >> 1) & 0xff)
+        struct.pack_into('<H', data, p, h0)
+        if field in ('call', 'jump19'):
+            struct.pack_into('<H', data, p + 2, h1)
+    elif field in ('movw', 'movt'):
+        if addend and not -0x8000 <= v < 0x8000:
+            return False
+        if field == 'movt' and not addend:
+            v >>= 16
+        h0, h1 = struct.unpack_from('<HH', data, p)
+        h0 = (h0 & 0xfbf0) | ((v >> 12) & 0xf) | (((v >> 11) & 1) << 10)
+        h1 = (h1 & 0x8f00) | (((v >> 8) & 7) << 12) | (v & 0xff)
+        struct.pack_into('<HH', data, p, h0, h1)
+    elif field == 'pc8':
+        if v & 3 or not (-4 if addend else 0) <= v <= (1016 if addend
+                                                        else 1020):
+            return False
+        h0, = struct.unpack_from('<H', data, p)
+        struct.pack_into('<H', data, p, (h0 & 0xff00) | ((v >> 2) & 0xff))
+    elif field == 'pc12':
+        if not -4095 <= v <= 4095:
+            return False
+        h0, h1 = struct.unpack_from('<HH', data, p)
+        h0 = (h0 & ~0x80) | (0x80 if v >= 0 else 0)
+        h1 = (h1 & 0xf000) | abs(v)
+        struct.pack_into('<HH', data, p, h0, h1)
+    return True
+
+
+class Module:
+    def __init__(self, elf, abi):
+        self.elf = elf
+        symtab = next(s for s in elf.sh if s[0][1] == SHT_SYMTAB)
+        self.strtab = elf.sh[symtab[0][6]][1]
+        self.syms = [struct.unpack_from('<IIIBBH', symtab[1], off)
+                     for off in range(0, len(symtab[1]), 16)]
+        self.ordinals = self.read_imports(abi)
+        self.place()
+
+    def sym_name(self, s):
+        return self.strtab[s[0]:self.strtab.index(b'\0', s[0])].decode()
+
+    def section(self, name):
+        return next((i for i in range(len(self.elf.sh))
+                     if self.elf.name(i) == name), None)
+
+    def entry_section(self, entry):
+        """Section of e_entry, chosen as findEntrySection() does"""
+        text, best, best_score = self.section('.text'), None, 0
+        for s in self.syms[1:]:
+            if (s[3] & 0xf != STT_FUNC or s[1] != entry
+                    or s[5] not in self.where
+                    or not self.elf.sh[s[5]][0][2] & SHF_EXECINSTR):
+                continue
+            if s[0] and self.sym_name(s) == '_start':
+                score = 4
+            elif s[5] == text:
+                score = 3
+            else:
+                score = 1 if s[3] >> 4 == STB_LOCAL else 2
+            if score > best_score:
+                best, best_score = s[5], score
+        return text if best is None else best
+
+    def read_imports(self, abi):
+        """{symbol index: ordinal}, ABI hash"""
+        i = self.section('.elfloader.imports')
+        if i is not None:
+            body = self.elf.sh[i][1]
+            magic, abi_hash, _, count = struct.unpack_from('<IIII', body)
+            if magic != IMPORTS_MAGIC:
+                raise SystemExit('bad .elfloader.imports')
+            self.abi_hash = abi_hash
+            return dict(struct.unpack_from('<II', body, 16 + 8 * n)
+                        for n in range(count))
+        self.abi_hash = 0
+        if not abi:
+            return {}
+        names, versions = read_abi(abi)
+        self.abi_hash = versions[-1][1]
+        ordinal = dict((n, i) for i, (n, _) in enumerate(names))
+        return dict((i, ordinal[self.sym_name(s)])
+                    for i, s in enumerate(self.syms)
+                    if i and s[5] == 0 and s[0]
+                    and self.sym_name(s) in ordinal)
+
+    def regions(self):
+        """Region name of each allocated section, as the loader would"""
+        region = {}
+        for i, (h, _) in enumerate(self.elf.sh):
+            if i and h[2] & SHF_ALLOC and h[5]:
+                sdram = self.elf.name(i).startswith('.sdram')
+                region[i] = 'sdram' if sdram else 'sram'
+        i = self.section('.elfloader.placement')
+        if i is not None:
+            body = bytes(self.elf.sh[i][1])
+            magic, count, size = struct.unpack_from('<III', body)
+            if magic != PLACEMENT_MAGIC:
+                raise SystemExit('bad .elfloader.placement')
+            names = body[12 + 4 * count:12 + 4 * count + size].split(b'\0')
+            for n in range(count):
+                sec, r = struct.unpack_from('<HH', body, 12 + 4 * n)
+                if sec in region:
+                    region[sec] = names[r].decode()
+        return region
+
+    def place(self):
+        """Segment and offset of every allocated section"""
+        region = self.regions()
+        self.segs = []
+        self.where = {}
+        for name in sorted(set(region.values()),
+                           key=lambda r: (r != 'sram', r)):
+            secs = [i for i in region if region[i] == name]
+            # Stored data first, largest alignment first within each class
+            secs.sort(key=lambda i: (self.elf.sh[i][0][1] == SHT_NOBITS,
+                                     -self.elf.sh[i][0][8], i))
+            seg = len(self.segs)
+            size = file_size = 0
+            perm = align = 0
+            for i in secs:
+                h = self.elf.sh[i][0]
+                a = max(h[8], 1)
+                size = (size + a - 1) & ~(a - 1)
+                self.where[i] = (seg, size)
+                size += h[5]
+                if h[1] != SHT_NOBITS:
+                    file_size = size
+                align = max(align, log2(a))
+                # SHF_WRITE/SHF_ALLOC/SHF_EXECINSTR match ELFSecPerm_t
+                perm |= h[2] & (SHF_WRITE | SHF_ALLOC | SHF_EXECINSTR)
+            data = bytearray(file_size)
+            for i in secs:
+                h, body = self.elf.sh[i]
+                if h[1] != SHT_NOBITS:
+                    off = self.where[i][1]
+                    data[off:off + h[5]] = body
+            self.segs.append(dict(name=name, size=size, data=data,
+                                  align=align, perm=perm, relocs=[]))
+
+    def relocate(self):
+        self.imports = []
+        index = {}
+        for h, body in self.elf.sh:
+            if h[1] not in (SHT_REL, SHT_RELA) or h[7] not in self.where:
+                continue
+            seg, base = self.where[h[7]]
+            data = self.segs[seg]['data']
+            size = 12 if h[1] == SHT_RELA else 8
+            for off in range(0, len(body), size):
+                r_offset, info = struct.unpack_from('<II', body, off)
+                rtype, symi = info & 0xff, info >> 8
+                sym = self.syms[symi]
+                p = base + r_offset
+                if rtype not in RELOCS:
+                    raise SystemExit('unsupported relocation %d' % rtype)
+                field, pc = RELOCS[rtype]
+                if field == 'none':
+                    continue
+                if sym[5] == 0:
+                    if symi not in index:
+                        index[symi] = len(self.imports)
+                        self.imports.append(symi)
+                    target = len(self.segs) + index[symi]
+                    addend = 0
+                else:
+                    if sym[5] not in self.where:
+                        raise SystemExit('symbol %d in unloaded section %d'
+                                         % (symi, sym[5]))
+                    target, addend = self.where[sym[5]]
+                    addend += sym[1]
+                if size == 12:
+                    addend += struct.unpack_from('<i', body, off + 8)[0]
+                else:
+                    addend += get_addend(field, data, p)
+                if (pc and target == seg
+                        and (pc == 'p' or self.segs[seg]['align'] >= 2)):
+                    # Same segment: distance known now, nothing left to do
+                    if not put_field(field, data, p,
+                                     addend - (p if pc == 'p' else p & ~3)):
+                        raise SystemExit('relocation %d at %x out of range'
+                                         % (rtype, p))
+                    continue
+                if put_field(field, data, p, addend, addend=True):
+                    self.segs[seg]['relocs'].append((p, rtype, target, None))
+                else:
+                    self.segs[seg]['relocs'].append((p, rtype, target,
+                                                     addend))
+        if len(self.segs) + len(self.imports) >= REL_ADDEND:
+            raise SystemExit('too many relocation targets')
+
+    def streams(self):
+        for seg in self.segs:
+            words = []
+            pos = 0
+            prev = None
+            for p, rtype, target, addend in sorted(
+                    seg['relocs'], key=lambda r: r[0]):
+                delta = p - pos
+                pos = p
+                if delta & 1:
+                    raise SystemExit('odd relocation offset %x' % p)
+                if (addend is None and (rtype, target) == prev
+                        and delta >> 1 <= 0xfff):
+                    w = words[-1]
+                    if ((w & 0xff) == 0 and w >> 20 == delta >> 1
+                            and 0 < (w >> 8) & 0xfff < REL_ADDEND - 1):
+                        words[-1] += 1 << 8
+                    else:
+                        words.append(((delta >> 1) << 20) | (1 << 8))
+                    continue
+                while delta >> 1 > 0xfff:
+                    words.append(0xfff << 20)
+                    delta -= 0xfff << 1
+                if addend is not None:
+                    words.append(REL_ADDEND << 8)
+                    words.append(addend & 0xffffffff)
+                    prev = None
+                else:
+                    prev = (rtype, target)
+                words.append(((delta >> 1) << 20) | (target << 8) | rtype)
+            seg['stream'] = words
+
+    def exports(self):
+        """Slots and names of the symbol index, as initSymIndex builds it"""
+        syms = []
+        for s in self.syms[1:]:
+            kind, bind = s[3] & 0xf, s[3] >> 4
+            if (s[0] and kind in (STT_FUNC, STT_OBJECT)
+                    and bind in (STB_GLOBAL, STB_WEAK) and s[5] in self.where):
+                seg, off = self.where[s[5]]
+                syms.append((self.sym_name(s), kind, seg, off + s[1]))
+        size = 2
+        while size < 2 * len(syms):
+            size *= 2
+        slots = [None] * size
+        names = bytearray(b'\0')
+        for name, kind, seg, off in syms:
+            h = name_hash(name, kind)
+            slot = h & (size - 1)
+            while slots[slot]:
+                slot = (slot + 1) & (size - 1)
+            slots[slot] = (h, (seg << 24) | off, len(names))
+            names += name.encode() + b'\0'
+        if not syms:
+            return b'', 0, 0, 0
+        body = b''.join(struct.pack('<III', *(s or (0, 0, 0))) for s in slots)
+        return body + names, size, len(names), len(syms)
+
+    def write(self):
+        self.relocate()
+        self.streams()
+        pool = bytearray(b'\0')
+
+        def string(s):
+            pool.extend(s.encode() + b'\0')
+            return len(pool) - len(s) - 1
+
+        arrays = []
+        for i, (h, _) in enumerate(self.elf.sh):
+            name = self.elf.name(i)
+            if i not in self.where:
+                continue
+            if h[1] == SHT_INIT_ARRAY or name.startswith('.init_array'):
+                arrays.append((ARRAY_INIT,) + self.where[i] + (h[5],))
+            elif h[1] == SHT_FINI_ARRAY or name.startswith('.fini_array'):
+                arrays.append((ARRAY_FINI,) + self.where[i] + (h[5],))
+        segs = [(string(s['name']), s['size'], len(s['data']), s['align'],
+                 s['perm'], len(s['stream'])) for s in self.segs]
+        imports = []
+        for symi in self.imports:
+            if symi in self.ordinals:
+                imports.append(IMPORT_ORDINAL | self.ordinals[symi])
+            else:
+                imports.append(string(self.sym_name(self.syms[symi])))
+        pool += b'\0' * (-len(pool) % 4)
+        entry_seg, entry = 0xffffffff, 0
+        e_entry = struct.unpack_from('<I', self.elf.ehdr, 24)[0]
+        text = self.entry_section(e_entry) if e_entry else None
+        if text in self.where:
+            entry_seg, entry = self.where[text]
+            entry += e_entry
+        index, slots, names, exports = self.exports()
+
+        out = bytearray(struct.pack(
+            '<10I', COMPACT_MAGIC, self.abi_hash, len(segs), len(arrays),
+            len(imports), len(pool), entry_seg, entry, slots, names))
+        for s in segs:
+            out += struct.pack('<6I', *s)
+        for a in arrays:
+            out += struct.pack('<4I', *a)
+        out += b''.join(struct.pack('<I', i) for i in imports)
+        out += pool
+        for s in self.segs:
+            out += s['data'] + b'\0' * (-len(s['data']) % 4)
+        for s in self.segs:
+            out += b''.join(struct.pack('<I', w) for w in s['stream'])
+        out += index
+        for s in self.segs:
+            sys.stderr.write(' %s: %d bytes (%d stored), %d relocation words\n'
+                             % (s['name'], s['size'], len(s['data']),
+                                len(s['stream'])))
+        sys.stderr.write(' %d imports, %d exports, %d bytes\n'
+                         % (len(imports), exports, len(out)))
+        return bytes(out)
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument('input', help='relocatable module (ld -r output)')
+    ap.add_argument('-o', '--output', required=True, help='output file')
+    ap.add_argument('-a', '--abi', help='host ABI list: bind imports to'
+                    ' ordinals (default: by name, or .elfloader.imports)')
+    args = ap.parse_args()
+    elf = Elf32(open(args.input, 'rb').read())
+    open(args.output, 'wb').write(Module(elf, args.abi).write())
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,227 @@
+#!/usr/bin/env python3
+#
+# ARMv7M ELF loader
+# Copyright (c) 2013-2015 Martin Ribelotta
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted under the terms of the BSD 3-clause license,
+# see LICENSE file.
+#
+"""Generate a flash resident export table for the ELF loader.
+
+Input is an export list, one entry per line:
+
+    name                 export host symbol "name"
+    name = host_symbol   export host symbol "host_symbol" as "name"
+    pattern*             export every matching global symbol of --elf
+    # comment
+
+The output C file defines `export_table` (ELFExportTable_t): a minimal
+perfect hash (hash and displace) over the exported names, so lookups take a
+single probe, with names stored as a path compressed trie, so the long
+shared prefixes of C++ mangled names are stored once.
+"""
+
+import argparse
+import fnmatch
+import struct
+import sys
+
+MASK = 0xffffffff
+
+
+def name_hash(name, seed=0):
+    """Must match elf_name_hash_seed() in loader.c"""
+    h = 2166136261 ^ seed
+    for c in name.encode():
+        h ^= c
+        h = (h * 16777619) & MASK
+    h ^= h >> 16
+    h = (h * 0x85ebca6b) & MASK
+    h ^= h >> 13
+    return h
+
+
+def elf_symbols(path):
+    """Global defined FUNC/OBJECT symbols of an ELF32 little endian file"""
+    data = open(path, 'rb').read()
+    if data[:4] != b'\x7fELF' or data[4] != 1 or data[5] != 1:
+        raise SystemExit('%s: not an ELF32 little endian file' % path)
+    shoff, = struct.unpack_from('<I', data, 0x20)
+    shentsize, shnum = struct.unpack_from('<HH', data, 0x2e)
+    sections = [struct.unpack_from('<IIIIIIIIII', data, shoff + i * shentsize)
+                for i in range(shnum)]
+    names = set()
+    for sh in sections:
+        if sh[1] != 2:  # SHT_SYMTAB
+            continue
+        strtab = sections[sh[6]]
+        for off in range(sh[4], sh[4] + sh[5], 16):
+            st_name, value, size, info, other, shndx = struct.unpack_from(
+                '<IIIBBH', data, off)
+            if shndx == 0 or (info >> 4) != 1 or (info & 0xf) not in (1, 2):
+                continue
+            start = strtab[4] + st_name
+            names.add(data[start:data.index(b'\0', start)].decode())
+    return names
+
+
+def read_exports(path, elf):
+    exports = {}
+    for n, line in enumerate(open(path), 1):
+        line = line.split('#', 1)[0].strip()
+        if not line:
+            continue
+        if '=' in line:
+            name, target = [x.strip() for x in line.split('=', 1)]
+            exports[name] = target
+        elif any(c in line for c in '*?['):
+            if elf is None:
+                raise SystemExit('%s:%d: pattern needs --elf' % (path, n))
+            for name in fnmatch.filter(sorted(elf), line):
+                exports[name] = name
+        else:
+            exports[line] = line
+    if elf is not None:
+        missing = [t for t in exports.values() if t not in elf]
+        if missing:
+            raise SystemExit('not in firmware: ' + ', '.join(sorted(missing)))
+    return exports
+
+
+def perfect_hash(names, load):
+    """Hash and displace: bucket = h(name) % m, slot = h(name, disp) % n"""
+    n = len(names)
+    m = max(1, (n + load - 1) // load)
+    buckets = [[] for _ in range(m)]
+    for name in names:
+        buckets[name_hash(name) % m].append(name)
+    slots = [None] * n
+    disp = [0] * m
+    for b in sorted(range(m), key=lambda b: -len(buckets[b])):
+        if not buckets[b]:
+            continue
+        for d in range(0x10000):
+            want = [name_hash(x, d) % n for x in buckets[b]]
+            if len(set(want)) == len(want) and all(slots[i] is None
+                                                   for i in want):
+                break
+        else:
+            return None
+        disp[b] = d
+        for x, i in zip(buckets[b], want):
+            slots[i] = x
+    return disp, slots
+
+
+def build_trie(names):
+    """Path compressed trie. Returns nodes [(parent, label)], terminals"""
+    root = {}
+    for name in names:
+        t = root
+        for c in name:
+            t = t.setdefault(c, {})
+        t[None] = name
+    nodes = [(0, '')]
+    terminal = {}
+
+    def walk(t, parent):
+        for c in sorted(k for k in t if k is not None):
+            label, child = c, t[c]
+            while None not in child and len(child) == 1 and len(label) < 255:
+                k = next(iter(child))
+                label, child = label + k, child[k]
+            nodes.append((parent, label))
+            idx = len(nodes) - 1
+            if None in child:
+                terminal[child[None]] = idx
+            walk(child, idx)
+
+    walk(root, 0)
+    return nodes, terminal
+
+
+def c_string(s):
+    out = ''
+    for c in s:
+        if c in '"\\':
+            out += '\\' + c
+        elif 32 <= ord(c) < 127:
+            out += c
+        else:
+            out += '\\%03o' % ord(c)
+    return '"%s"' % out
+
+
+def emit(out, exports, disp, slots, nodes, terminal):
+    pool = ''
+    labels = []
+    for parent, label in nodes:
+        pos = pool.find(label)
+        if pos < 0:
+            pos = len(pool)
+            pool += label
+        labels.append(pos)
+    if len(nodes) > 0xffff or len(pool) > 0xffff:
+        raise SystemExit('too many exports for 16 bit tables')
+
+    targets = sorted(set(exports.values()))
+    w = out.write
+    w('/* Generated by tools/mkexports.py, do not edit */\n\n')
+    w('#include "loader.h"\n#include "loader_config.h"\n\n')
+    for i, t in enumerate(targets):
+        w('extern char export_sym_%d[] __asm__(%s);\n' % (i, c_string(t)))
+    w('\nstatic const uint16_t export_disp[] = {')
+    w(','.join('\n  %d' % d for d in disp))
+    w('\n};\n\nstatic const uint16_t export_node[] = {')
+    w(','.join('\n  %d /* %s */' % (terminal[s], s) for s in slots))
+    w('\n};\n\nstatic void * const export_ptr[] = {')
+    w(','.join('\n  export_sym_%d' % targets.index(exports[s]) for s in slots))
+    w('\n};\n\nstatic const ELFTrieNode_t export_nodes[] = {')
+    w(','.join('\n  { %d, %d, %d }' % (p, labels[i], len(l))
+               for i, (p, l) in enumerate(nodes)))
+    w('\n};\n\nstatic const char export_labels[] =')
+    for i in range(0, len(pool), 64):
+        w('\n  ' + c_string(pool[i:i + 64]))
+    if not pool:
+        w(' ""')
+    w(';\n\nconst ELFExportTable_t export_table = {\n')
+    w('  %d, %d, export_disp, export_node, export_ptr, export_nodes,'
+      ' export_labels\n};\n' % (len(slots), len(disp)))
+    return len(pool) + 6 * len(nodes), sum(len(s) + 1 for s in slots)
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument('exports', help='export list')
+    ap.add_argument('-e', '--elf', help='linked firmware to check/expand'
+                    ' the export list against')
+    ap.add_argument('-o', '--output', default='-', help='output C file')
+    ap.add_argument('-l', '--load', type=int, default=4,
+                    help='names per displacement bucket (default 4)')
+    args = ap.parse_args()
+
+    elf = elf_symbols(args.elf) if args.elf else None
+    exports = read_exports(args.exports, elf)
+    if not exports:
+        raise SystemExit('empty export list')
+    names = sorted(exports)
+    load = args.load
+    while True:
+        ph = perfect_hash(names, load)
+        if ph:
+            break
+        if load == 1:
+            raise SystemExit('no perfect hash found')
+        load //= 2
+    disp, slots = ph
+    nodes, terminal = build_trie(names)
+    out = sys.stdout if args.output == '-' else open(args.output, 'w')
+    trie, plain = emit(out, exports, disp, slots, nodes, terminal)
+    sys.stderr.write(' %d exports, names %d bytes (%d as plain strings)\n'
+                     % (len(names), trie, plain))
+
+
+if __name__ == '__main__':
+    main()
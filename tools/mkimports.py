@@ -0,0 +1,205 @@
+#!/usr/bin/env python3
+#
+# ARMv7M ELF loader
+# Copyright (c) 2013-2015 Martin Ribelotta
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted under the terms of the BSD 3-clause license,
+# see LICENSE file.
+#
+"""Ordinal based imports for the ELF loader.
+
+The host ABI is an ordered list of exported names (host/abi.txt). The
+position of a name is its ordinal and must never change: new names are
+only appended. "@version" lines freeze the ABI up to that point:
+
+    syscalls = sysentries
+    @version 1
+
+  host    generate the host ABI table (ELFAbi_t "abi_table") as C source
+  module  bind the undefined symbols of a module to ordinals: adds an
+          .elfloader.imports section and, with --strip, drops every name
+          the loader no longer needs from .strtab
+"""
+
+import argparse
+import struct
+import sys
+
+from mkexports import name_hash, c_string
+
+IMPORTS_MAGIC = 0x49464c45  # "ELFI"
+SHT_NOBITS = 8
+SHT_SYMTAB = 2
+STB_LOCAL = 0
+
+
+def read_abi(path):
+    """Returns [(name, host_symbol)] in ordinal order, [(count, hash)]"""
+    names, versions = [], []
+    h = 0
+    for n, line in enumerate(open(path), 1):
+        line = line.split('#', 1)[0].strip()
+        if not line:
+            continue
+        if line.startswith('@version'):
+            versions.append((len(names), h))
+            continue
+        name, _, target = line.partition('=')
+        name = name.strip()
+        if any(name == x for x, _ in names):
+            raise SystemExit('%s:%d: duplicate %s' % (path, n, name))
+        names.append((name, target.strip() or name))
+        h = name_hash(name, h)
+    if not versions or versions[-1][0] != len(names):
+        versions.append((len(names), h))
+    return names, versions
+
+
+def host(args):
+    names, versions = read_abi(args.abi)
+    targets = sorted(set(t for _, t in names))
+    out = sys.stdout if args.output == '-' else open(args.output, 'w')
+    w = out.write
+    w('/* Generated by tools/mkimports.py, do not edit */\n\n')
+    w('#include "loader.h"\n#include "loader_config.h"\n\n')
+    for i, t in enumerate(targets):
+        w('extern char abi_sym_%d[] __asm__(%s);\n' % (i, c_string(t)))
+    w('\nstatic void * const abi_ptr[] = {')
+    w(','.join('\n  abi_sym_%d /* %d: %s */' % (targets.index(t), i, n)
+               for i, (n, t) in enumerate(names)))
+    w('\n};\n\nstatic const ELFAbiVersion_t abi_versions[] = {')
+    w(','.join('\n  { %d, 0x%08xu }' % v for v in versions))
+    w('\n};\n\nconst ELFAbi_t abi_table = {\n')
+    w('  abi_ptr, %d, abi_versions, %d\n};\n' % (len(names), len(versions)))
+
+
+class Elf32:
+    """Minimal ET_REL reader/writer: keeps every section, relays them out"""
+
+    def __init__(self, data):
+        if data[:4] != b'\x7fELF' or data[4] != 1 or data[5] != 1:
+            raise SystemExit('not an ELF32 little endian file')
+        self.ehdr = bytearray(data[:52])
+        shoff, = struct.unpack_from('<I', data, 0x20)
+        shentsize, shnum, self.shstrndx = struct.unpack_from('<HHH', data,
+                                                             0x2e)
+        self.sh = []
+        for i in range(shnum):
+            h = list(struct.unpack_from('<IIIIIIIIII', data,
+                                        shoff + i * shentsize))
+            body = b'' if h[1] == SHT_NOBITS else data[h[4]:h[4] + h[5]]
+            self.sh.append([h, bytearray(body)])
+
+    def name(self, i):
+        strs = self.sh[self.shstrndx][1]
+        off = self.sh[i][0][0]
+        return strs[off:strs.index(b'\0', off)].decode()
+
+    def add_section(self, name, sh_type, body, align=4):
+        strs = self.sh[self.shstrndx][1]
+        off = len(strs)
+        strs += name.encode() + b'\0'
+        self.sh.append([[off, sh_type, 0, 0, 0, len(body), 0, 0, align, 0],
+                        bytearray(body)])
+        return len(self.sh) - 1
+
+    def write(self):
+        out = bytearray(self.ehdr)
+        for h, body in self.sh[1:]:
+            if h[1] != SHT_NOBITS:
+                align = max(h[8], 1)
+                out += b'\0' * (-len(out) % align)
+                h[4] = len(out)
+                h[5] = len(body)
+                out += body
+        out += b'\0' * (-len(out) % 4)
+        struct.pack_into('<I', out, 0x20, len(out))
+        struct.pack_into('<HHH', out, 0x2e, 40, len(self.sh), self.shstrndx)
+        for h, _ in self.sh:
+            out += struct.pack('<IIIIIIIIII', *h)
+        return bytes(out)
+
+
+def module(args):
+    names, versions = read_abi(args.abi)
+    ordinal = dict((n, i) for i, (n, _) in enumerate(names))
+    abi_count, abi_hash = versions[-1]
+    elf = Elf32(open(args.input, 'rb').read())
+    if any(elf.name(i) == '.elfloader.imports' for i in range(len(elf.sh))):
+        raise SystemExit('%s: imports already bound' % args.input)
+    symtab = next(s for s in elf.sh if s[0][1] == SHT_SYMTAB)
+    strtab = elf.sh[symtab[0][6]][1]
+    syms = [list(struct.unpack_from('<IIIBBH', symtab[1], off))
+            for off in range(0, len(symtab[1]), 16)]
+
+    imports = []
+    missing = []
+    for i, s in enumerate(syms[1:], 1):
+        if s[5] != 0 or not s[0]:
+            continue
+        name = strtab[s[0]:strtab.index(b'\0', s[0])].decode()
+        if name not in ordinal:
+            missing.append(name)
+        else:
+            imports.append((i, ordinal[name]))
+    if missing:
+        raise SystemExit('not in host ABI: ' + ', '.join(sorted(missing)))
+
+    body = struct.pack('<IIII', IMPORTS_MAGIC, abi_hash, abi_count,
+                       len(imports))
+    for i, o in imports:
+        body += struct.pack('<II', i, o)
+    elf.add_section('.elfloader.imports', 1, body)
+
+    if args.strip:
+        # Only global definitions are looked up by name (get_sym)
+        new = bytearray(b'\0')
+        seen = {}
+
+        def keep(off):
+            name = bytes(strtab[off:strtab.index(b'\0', off)])
+            if name not in seen:
+                seen[name] = len(new)
+                new.extend(name + b'\0')
+            return seen[name]
+
+        if symtab[0][6] == elf.shstrndx:
+            # Some assemblers share one string table for sections and symbols
+            for h, _ in elf.sh[1:]:
+                h[0] = keep(h[0])
+        for s in syms[1:]:
+            if not s[0]:
+                continue
+            if s[5] == 0 or (s[3] >> 4) == STB_LOCAL:
+                s[0] = 0
+            else:
+                s[0] = keep(s[0])
+        sys.stderr.write(' .strtab %d -> %d bytes\n' % (len(strtab), len(new)))
+        strtab[:] = new
+        symtab[1][:] = b''.join(struct.pack('<IIIBBH', *s) for s in syms)
+
+    open(args.output or args.input, 'wb').write(elf.write())
+    sys.stderr.write(' %d imports bound to ABI %08x (%d ordinals)\n'
+                     % (len(imports), abi_hash, abi_count))
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    sub = ap.add_subparsers(dest='cmd', required=True)
+    h = sub.add_parser('host', help='generate host ABI table')
+    h.add_argument('abi', help='ABI list')
+    h.add_argument('-o', '--output', default='-', help='output C file')
+    m = sub.add_parser('module', help='bind module imports to ordinals')
+    m.add_argument('input', help='relocatable module (ld -r output)')
+    m.add_argument('-a', '--abi', required=True, help='ABI list')
+    m.add_argument('-o', '--output', help='output file (default in place)')
+    m.add_argument('-s', '--strip', action='store_true',
+                   help='drop names not needed by the loader')
+    args = ap.parse_args()
+    host(args) if args.cmd == 'host' else module(args)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,130 @@
+#!/usr/bin/env python3
+#
+# ARMv7M ELF loader
+# Copyright (c) 2013-2015 Martin Ribelotta
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted under the terms of the BSD 3-clause license,
+# see LICENSE file.
+#
+"""Profile guided placement of module sections.
+
+Input is a module built with -ffunction-sections (one .text.<fn> section
+per function) and a function level profile, one entry per line:
+
+    12345 function_name     samples (or calls) of function_name
+    # comment
+
+gathered by any means: PC sampling on target symbolized with addr2line, an
+instrumented (-finstrument-functions) run, a host side run...
+
+The hottest sections, up to --fraction of all samples and --max-hot bytes,
+are assigned to the --hot region and code never seen in the profile to the
+--cold region. The result is stored in the module as .elfloader.placement,
+which the loader applies on top of the host placement rules by region name.
+Regions the host doesn't have are ignored, so the same module loads
+everywhere.
+"""
+
+import argparse
+import struct
+import sys
+
+from mkimports import Elf32, SHT_SYMTAB
+
+PLACEMENT_MAGIC = 0x50464c45  # "ELFP"
+SHF_ALLOC = 2
+SHF_EXECINSTR = 4
+STT_FUNC = 2
+
+
+def read_profile(path):
+    samples = {}
+    for n, line in enumerate(open(path), 1):
+        line = line.split('#', 1)[0].split()
+        if not line:
+            continue
+        if len(line) != 2 or not line[0].isdigit():
+            raise SystemExit('%s:%d: expected "<count> <function>"' % (path, n))
+        samples[line[1]] = samples.get(line[1], 0) + int(line[0])
+    return samples
+
+
+def code_sections(elf):
+    """{section index: [function names]} of allocated executable sections"""
+    sections = dict((i, []) for i, (h, _) in enumerate(elf.sh)
+                    if i and h[2] & SHF_ALLOC and h[2] & SHF_EXECINSTR
+                    and h[5])
+    symtab = next(s for s in elf.sh if s[0][1] == SHT_SYMTAB)
+    strtab = elf.sh[symtab[0][6]][1]
+    for off in range(0, len(symtab[1]), 16):
+        st_name, _, _, info, _, shndx = struct.unpack_from('<IIIBBH',
+                                                           symtab[1], off)
+        if (info & 0xf) == STT_FUNC and shndx in sections and st_name:
+            name = strtab[st_name:strtab.index(b'\0', st_name)].decode()
+            sections[shndx].append(name)
+    return sections
+
+
+def plan(elf, samples, fraction, max_hot):
+    sections = code_sections(elf)
+    weight = dict((i, sum(samples.get(f, 0) for f in fns))
+                  for i, fns in sections.items())
+    total = sum(weight.values())
+    if not total:
+        raise SystemExit('no profiled function found in module')
+    for i, fns in sections.items():
+        if len(fns) > 1 and weight[i]:
+            sys.stderr.write(' warning: %s holds %d functions, build with'
+                             ' -ffunction-sections\n'
+                             % (elf.name(i), len(fns)))
+    hot, cold = [], []
+    acc = size = 0
+    for i in sorted(sections, key=lambda i: -weight[i]):
+        if not weight[i]:
+            cold.append(i)
+        elif acc < fraction * total and size + elf.sh[i][0][5] <= max_hot:
+            hot.append(i)
+            acc += weight[i]
+            size += elf.sh[i][0][5]
+    sys.stderr.write(' hot: %d sections, %d bytes, %.1f%% of samples\n'
+                     % (len(hot), size, 100.0 * acc / total))
+    sys.stderr.write(' cold: %d sections, %d bytes\n'
+                     % (len(cold), sum(elf.sh[i][0][5] for i in cold)))
+    return hot, cold
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument('input', help='relocatable module (ld -r output)')
+    ap.add_argument('-p', '--profile', required=True, help='function profile')
+    ap.add_argument('-o', '--output', help='output file (default in place)')
+    ap.add_argument('--hot', default='CCM', help='region of hot code'
+                    ' (default CCM)')
+    ap.add_argument('--cold', help='region of never executed code'
+                    ' (default: host rules)')
+    ap.add_argument('--fraction', type=float, default=0.9,
+                    help='fraction of samples to cover with hot code'
+                    ' (default 0.9)')
+    ap.add_argument('--max-hot', type=int, default=1 << 30,
+                    help='size budget of hot region in bytes')
+    args = ap.parse_args()
+
+    elf = Elf32(open(args.input, 'rb').read())
+    if any(elf.name(i) == '.elfloader.placement' for i in range(len(elf.sh))):
+        raise SystemExit('%s: placement already present' % args.input)
+    hot, cold = plan(elf, read_profile(args.profile), args.fraction,
+                     args.max_hot)
+    regions = [args.hot] + ([args.cold] if args.cold else [])
+    entries = [(i, 0) for i in hot] + [(i, 1) for i in cold if args.cold]
+    names = b''.join(r.encode() + b'\0' for r in regions)
+    body = struct.pack('<III', PLACEMENT_MAGIC, len(entries), len(names))
+    body += b''.join(struct.pack('<HH', i, r) for i, r in entries)
+    body += names + b'\0' * (-len(names) % 4)
+    elf.add_section('.elfloader.placement', 1, body)
+    open(args.output or args.input, 'wb').write(elf.write())
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,89 @@
+#!/usr/bin/env python3
+#
+# ARMv7M ELF loader
+# Copyright (c) 2013-2015 Martin Ribelotta
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted under the terms of the BSD 3-clause license,
+# see LICENSE file.
+#
+"""Stream friendly layout of modules for load_elf_stream().
+
+A stream can't seek: the loader reads the module once, front to back. This
+relays out a relocatable module (sections and their indexes are kept, only
+file offsets change) in the order the loader consumes it:
+
+    ELF header, section header table
+    section names, symbol table, symbol names    buffered by the loader
+    .elfloader.placement, .elfloader.imports
+    each allocated section, then its relocations  loaded and relocated
+    everything else (attributes, debug info)      skipped
+"""
+
+import argparse
+import struct
+import sys
+
+from mkimports import Elf32, SHT_NOBITS, SHT_SYMTAB
+
+SHT_RELA = 4
+SHT_REL = 9
+SHF_ALLOC = 2
+MANIFESTS = ('.elfloader.placement', '.elfloader.imports')
+
+
+def stream_order(elf):
+    """Section indexes in file order"""
+    sh = [h for h, _ in elf.sh]
+    symtab = next(i for i, h in enumerate(sh) if h[1] == SHT_SYMTAB)
+    order = [elf.shstrndx, symtab, sh[symtab][6]]
+    order += [i for m in MANIFESTS for i in range(1, len(sh))
+              if elf.name(i) == m]
+    for i in range(1, len(sh)):
+        if sh[i][2] & SHF_ALLOC:
+            order.append(i)
+            order += [r for r in range(1, len(sh))
+                      if sh[r][1] in (SHT_REL, SHT_RELA) and sh[r][7] == i]
+    order += range(1, len(sh))
+    return [i for n, i in enumerate(order) if i not in order[:n]]
+
+
+def write(elf, order):
+    out = bytearray(elf.ehdr)
+    shoff = len(out)
+    out += b'\0' * (40 * len(elf.sh))
+    for i in order:
+        h, body = elf.sh[i]
+        if h[1] != SHT_NOBITS:
+            out += b'\0' * (-len(out) % max(h[8], 1))
+            h[5] = len(body)
+        h[4] = len(out)
+        if h[1] != SHT_NOBITS:
+            out += body
+    struct.pack_into('<I', out, 0x20, shoff)
+    struct.pack_into('<HHH', out, 0x2e, 40, len(elf.sh), elf.shstrndx)
+    for i, (h, _) in enumerate(elf.sh):
+        struct.pack_into('<IIIIIIIIII', out, shoff + 40 * i, *h)
+    return bytes(out)
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument('input', help='relocatable module (ld -r output)')
+    ap.add_argument('-o', '--output', help='output file (default in place)')
+    args = ap.parse_args()
+
+    elf = Elf32(open(args.input, 'rb').read())
+    if struct.unpack_from('<H', elf.ehdr, 0x10)[0] != 1:
+        raise SystemExit('%s: only relocatable modules can be streamed'
+                         % args.input)
+    if not any(h[1] == SHT_SYMTAB for h, _ in elf.sh):
+        raise SystemExit('%s: no symbol table' % args.input)
+    data = write(elf, stream_order(elf))
+    open(args.output or args.input, 'wb').write(data)
+    sys.stderr.write(' %d sections, %d bytes\n' % (len(elf.sh) - 1, len(data)))
+
+
+if __name__ == '__main__':
+    main()